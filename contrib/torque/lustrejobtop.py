@@ -26,13 +26,22 @@ def qstat():
         jobs[jobid] = j
     return jobs
 
-def lltop(hostlist):
-    lltop = os.popen(" ".join([LLTOPCMD, "-i", str(DELAY), "-l"] + hostlist)).readlines()
+def lltop(hostlist, ranks):
+    # one "TOP <rank>" section per rank, each with the top TOPLINES
+    # hosts and an OTHER line adding up the rest
+    lltop = os.popen(" ".join([LLTOPCMD, "-i", str(DELAY), "-n", str(TOPLINES),
+                               "--no-header", "--rank=" + ",".join(ranks), "-l"]
+                              + hostlist)).readlines()
     #lltop = file("/tmp/lltop.txt", "r").readlines()
-    lltopdata = list()
-    for line in lltop[1:]:
+    lltopdata = dict()
+    for line in lltop:
         items = line.strip().split()
-        lltopdata.append([items[0]] + map(int, items[1:]))
+        if not items:
+            continue
+        if items[0] == "TOP":
+            section = lltopdata.setdefault(items[1], list())
+            continue
+        section.append([items[0]] + map(int, items[1:]))
     return lltopdata
 
 def nodejobs(status):
@@ -49,8 +58,11 @@ def lustre_to_torque(clientname):
 
 def printstats(lltopdata, nodeinfo, joblist):
     print "host          write MB    read MB     reqs   jobid(user)"
-    for llt in lltopdata[:TOPLINES]:
+    for llt in lltopdata:
         print "%10s %10s %10s %10s" % tuple(llt),
+        if llt[0] == "OTHER":
+            print
+            continue
         hostname = lustre_to_torque(llt[0])
         if hostname in nodeinfo:
             jobs = nodejobs(str(nodeinfo[hostname].status))
@@ -67,24 +79,18 @@ def printsummary(lltopdata):
     print "Total: writes %s MB/s, reads %s MB/s, iop/s %s" % (total_writemb/DELAY, total_readmb/DELAY, total_reqs/DELAY)
 
 def main():
-    lltopdata = lltop(OSSLIST)
+    lltopdata = lltop(OSSLIST, ["wr", "rd", "reqs"])
     nodeinfo = pbsnodes()
     joblist = qstat()
 
-    writecol = lambda x: x[1]
-    readcol = lambda x: x[2]
-    iopcol = lambda x: x[3]
     print "top writers"
-    lltopdata.sort(key=writecol, reverse=True)
-    printstats(lltopdata, nodeinfo, joblist)
+    printstats(lltopdata["wr"], nodeinfo, joblist)
     print "top readers"
-    lltopdata.sort(key=readcol, reverse=True)
-    printstats(lltopdata, nodeinfo, joblist)
+    printstats(lltopdata["rd"], nodeinfo, joblist)
     print "top iops"
-    lltopdata.sort(key=iopcol, reverse=True)
-    printstats(lltopdata, nodeinfo, joblist)
+    printstats(lltopdata["reqs"], nodeinfo, joblist)
 
-    printsummary(lltopdata)
+    printsummary(lltopdata["wr"])
 
 if __name__ == "__main__":
     main()
@@ -0,0 +1,255 @@
+/* lltop coproc.c
+ * Copyright 2010 by John L. Hammond <jhammond@tacc.utexas.edu>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA.
+ */
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "lltop.h"
+#include "coproc.h"
+
+#define COPROC_BUF_SIZE 4096
+
+/* Give up on a co-process that makes no progress for this long. */
+#define COPROC_TIMEOUT 60000
+
+static int coproc_read(struct coproc *cp, int timeout)
+{
+  /* Read more of cp's output into cp_buf.  Returns the number of
+   * bytes read, 0 on EOF or timeout, -1 on error. */
+  struct pollfd pfd = { .fd = cp->cp_out, .events = POLLIN, };
+
+  if (cp->cp_len == cp->cp_size) {
+    cp->cp_size *= 2;
+    cp->cp_buf = realloc(cp->cp_buf, cp->cp_size);
+    if (cp->cp_buf == NULL)
+      FATAL("out of memory\n");
+  }
+
+  while (1) {
+    int nr_ready = poll(&pfd, 1, timeout);
+    if (nr_ready < 0 && errno == EINTR)
+      continue;
+    if (nr_ready <= 0)
+      return nr_ready;
+
+    ssize_t nr = read(cp->cp_out, cp->cp_buf + cp->cp_len, cp->cp_size - cp->cp_len);
+    if (nr < 0 && errno == EINTR)
+      continue;
+    if (nr > 0)
+      cp->cp_len += nr;
+    return nr;
+  }
+}
+
+int coproc_start(struct coproc *cp, const char *cmd)
+{
+  int in[2], out[2];
+  size_t len = strlen(COPROC_GREETING);
+  char *cmd_line = NULL;
+
+  memset(cp, 0, sizeof(*cp));
+  cp->cp_cmd = cmd;
+  cp->cp_in = cp->cp_out = -1;
+
+  /* Like command() in hooks.c, pass the argument on the command line. */
+  if (asprintf(&cmd_line, "%s %s", cmd, COPROC_ARG) < 0)
+    return -1;
+
+  /* Close on exec, so that ssh and other children don't keep the
+   * pipes open. */
+  if (pipe2(in, O_CLOEXEC) < 0) {
+    free(cmd_line);
+    return -1;
+  }
+
+  if (pipe2(out, O_CLOEXEC) < 0) {
+    close(in[0]);
+    close(in[1]);
+    free(cmd_line);
+    return -1;
+  }
+
+  cp->cp_pid = fork();
+  if (cp->cp_pid < 0) {
+    ERROR("cannot fork: %m\n");
+    close(in[0]);
+    close(in[1]);
+    close(out[0]);
+    close(out[1]);
+    free(cmd_line);
+    return -1;
+  } else if (cp->cp_pid == 0) {
+    dup2(in[0], 0);
+    dup2(out[1], 1);
+    setenv(COPROC_ENV, "1", 1);
+    execl("/bin/sh", "sh", "-c", cmd_line, (char *) NULL);
+    _exit(127);
+  }
+
+  free(cmd_line);
+  close(in[0]);
+  close(out[1]);
+  cp->cp_in = in[1];
+  cp->cp_out = out[0];
+  cp->cp_size = COPROC_BUF_SIZE;
+  cp->cp_buf = alloc(cp->cp_size);
+
+  while (memchr(cp->cp_buf, '\n', cp->cp_len) == NULL)
+    if (coproc_read(cp, COPROC_GREETING_TIMEOUT) <= 0)
+      break;
+
+  if (cp->cp_len < len || memcmp(cp->cp_buf, COPROC_GREETING, len) != 0) {
+    TRACE("`%s' is not a co-process\n", cmd);
+    kill(cp->cp_pid, SIGTERM);
+    coproc_stop(cp);
+    return -1;
+  }
+
+  cp->cp_len -= len;
+  memmove(cp->cp_buf, cp->cp_buf + len, cp->cp_len);
+
+  return 0;
+}
+
+static char *first_word(char *line)
+{
+  /* Like the fscanf("%s") in command(), take the first word. */
+  char *end;
+
+  while (isspace((unsigned char) *line))
+    line++;
+
+  for (end = line; *end != 0 && !isspace((unsigned char) *end); end++)
+    ;
+
+  if (end == line)
+    return NULL;
+
+  if (end - line > MAXNAME)
+    end = line + MAXNAME;
+
+  return strndup(line, end - line);
+}
+
+int coproc_batch(struct coproc *cp, char **keys, char **vals, size_t count)
+{
+  size_t i, out_len = 0, out_off = 0, nr_vals = 0;
+  char *out, *p;
+
+  if (cp->cp_pid <= 0)
+    goto dead;
+
+  for (i = 0; i < count; i++)
+    out_len += strlen(keys[i]) + 1;
+
+  p = out = alloc(out_len);
+  for (i = 0; i < count; i++) {
+    p = stpcpy(p, keys[i]);
+    *p++ = '\n';
+  }
+
+  /* Keep writing questions while we read answers, or we could both
+   * block on full pipes. */
+  fcntl(cp->cp_in, F_SETFL, fcntl(cp->cp_in, F_GETFL) | O_NONBLOCK);
+
+  while (nr_vals < count) {
+    struct pollfd pfd[2] = {
+      { .fd = cp->cp_out, .events = POLLIN, },
+      { .fd = cp->cp_in, .events = POLLOUT, },
+    };
+
+    int nr_ready = poll(pfd, out_off < out_len ? 2 : 1, COPROC_TIMEOUT);
+    if (nr_ready < 0) {
+      if (errno == EINTR)
+        continue;
+      ERROR("cannot poll `%s': %m\n", cp->cp_cmd);
+      break;
+    }
+
+    if (nr_ready == 0) {
+      ERROR("timed out waiting for `%s'\n", cp->cp_cmd);
+      break;
+    }
+
+    if (out_off < out_len && pfd[1].revents != 0) {
+      ssize_t nr = write(cp->cp_in, out + out_off, out_len - out_off);
+      if (nr < 0 && errno != EINTR && errno != EAGAIN) {
+        ERROR("cannot write to `%s': %m\n", cp->cp_cmd);
+        break;
+      }
+      if (nr > 0)
+        out_off += nr;
+    }
+
+    if (pfd[0].revents == 0)
+      continue;
+
+    if (coproc_read(cp, 0) <= 0) {
+      ERROR("`%s' exited early\n", cp->cp_cmd);
+      break;
+    }
+
+    char *line = cp->cp_buf, *end = cp->cp_buf + cp->cp_len, *eol;
+    while (nr_vals < count && (eol = memchr(line, '\n', end - line)) != NULL) {
+      *eol = 0;
+      vals[nr_vals++] = first_word(line);
+      line = eol + 1;
+    }
+
+    cp->cp_len = end - line;
+    memmove(cp->cp_buf, line, cp->cp_len);
+  }
+
+  free(out);
+
+  if (nr_vals == count)
+    return 0;
+
+  /* Don't try to talk to it again. */
+  kill(cp->cp_pid, SIGTERM);
+  coproc_stop(cp);
+
+ dead:
+  for (i = nr_vals; i < count; i++)
+    vals[i] = NULL;
+
+  return -1;
+}
+
+void coproc_stop(struct coproc *cp)
+{
+  if (cp->cp_in >= 0)
+    close(cp->cp_in);
+  if (cp->cp_out >= 0)
+    close(cp->cp_out);
+  if (cp->cp_pid > 0)
+    waitpid(cp->cp_pid, NULL, 0);
+
+  free(cp->cp_buf);
+  cp->cp_buf = NULL;
+  cp->cp_in = cp->cp_out = -1;
+  cp->cp_pid = 0;
+}
@@ -0,0 +1,44 @@
+#ifndef _COPROC_H_
+#define _COPROC_H_
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Co-process protocol for external get-host and get-job commands.
+   lltop runs the command once, with COPROC_ARG as its only argument
+   and with LLTOP_COPROCESS=1 in its environment.  Older commands take
+   COPROC_ARG for an address or host they can't resolve, and fail.  A
+   command that speaks the protocol first prints the line
+   COPROC_GREETING.  Then, for each
+   line it reads on stdin (an address or a host), it prints one line:
+   the answer, or an empty line if it has none.  Answers come back in
+   the order of the questions.  The command should exit at EOF. */
+
+#define COPROC_ARG "--lltop-coprocess"
+#define COPROC_ENV "LLTOP_COPROCESS"
+#define COPROC_GREETING "lltop-coprocess 1\n"
+
+/* How long to wait for the greeting, in milliseconds. */
+#define COPROC_GREETING_TIMEOUT 5000
+
+struct coproc {
+  const char *cp_cmd;
+  pid_t cp_pid;
+  int cp_in, cp_out; /* Command's stdin and stdout. */
+  char *cp_buf;
+  size_t cp_len, cp_size;
+};
+
+/* Start cmd (with /bin/sh -c) and wait for the greeting.  Returns 0
+   if cmd speaks the protocol, -1 (with cmd gone) if it doesn't. */
+int coproc_start(struct coproc *cp, const char *cmd);
+
+/* Send keys[0..count) to cp, writing and reading at the same time,
+   and set vals[i] to the malloc()ed first word of each answer, or to
+   NULL for an empty answer.  Returns -1 if cp died part way, in which
+   case the remaining vals are NULL. */
+int coproc_batch(struct coproc *cp, char **keys, char **vals, size_t count);
+
+/* Close cp's stdin and reap it. */
+void coproc_stop(struct coproc *cp);
+
+#endif
@@ -18,28 +18,69 @@
  */
 #define _GNU_SOURCE
 #include <dirent.h>
+#include <dlfcn.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <sys/syscall.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include "lltop.h"
+#include "coproc.h"
+#include "plugin.h"
 #include "hooks.h"
 
 int lltop_intvl = DEFAULT_LLTOP_INTVL;
+int lltop_limit = INT_MAX;
+const char *lltop_rank_names[LLTOP_NR_RANKS] = {
+  [LLTOP_RANK_WR] = "wr",
+  [LLTOP_RANK_RD] = "rd",
+  [LLTOP_RANK_REQS] = "reqs",
+  [LLTOP_RANK_TOTAL] = "total",
+};
+int lltop_rank_vec[LLTOP_NR_RANKS] = { LLTOP_RANK_WR, };
+int lltop_rank_count = 1;
+int lltop_job_stats = 0;
+int lltop_binary = 0;
+int lltop_serv_stats = 0;
+int lltop_deadline = 0;
+int lltop_max_sessions = 0;
+int lltop_start_rate = 0;
+int lltop_persist = 0;
+int lltop_resolvers = DEFAULT_LLTOP_RESOLVERS;
+const char *lltop_cache_path = NULL;
+int lltop_host_ttl = DEFAULT_LLTOP_HOST_TTL;
+int lltop_job_ttl = DEFAULT_LLTOP_JOB_TTL;
+int lltop_share = 0;
+const char *lltop_share_dir = NULL; /* Default depends on uid. */
+int lltop_share_age = -1; /* The interval. */
+int lltop_emit = 0;
+int lltop_ready = 0;
+char **lltop_relay_list = NULL;
+int lltop_relay_count = 0;
+const char *lltop_relay_path = "lltop";
 const char *lltop_ssh_path = "/usr/bin/ssh";
 const char *lltop_serv_path = "lltop-serv";
+const char *lltop_serv_socket = NULL;
+const char *lltop_serv_baseline = NULL;
+const char *lltop_serv_share = NULL;
 int (*lltop_get_host)(const char *addr, char *host, size_t host_size);
 int (*lltop_get_job)(const char *host, char *job, size_t job_size);
 int (*lltop_job_map)(void);
+int (*lltop_get_host_batch)(char **addrs, char **hosts, size_t count);
+int (*lltop_get_job_batch)(char **hosts, char **jobs, size_t count);
 
 static int serv_list_from_args = 0;
 static int get_serv_list(const char *fs_name, char ***serv_list, int *serv_count);
+static int get_relay_list(const char *arg);
+static int get_rank_list(const char *arg);
 
 static const char *get_host_path = NULL;
 static int external_get_host(const char *addr, char *host, size_t host_size);
@@ -50,14 +91,86 @@ static int getnameinfo_get_host(const char *addr, char *host, size_t host_size);
 static const char *get_job_path = NULL;
 static int external_get_job(const char *host, char *job, size_t job_size);
 
+static struct coproc get_host_coproc, get_job_coproc;
+static int coproc_get_host_init(const char *cmd);
+static void coproc_get_host_fini(void);
+static int coproc_get_host_batch(char **addrs, char **hosts, size_t count);
+static int coproc_get_job_init(const char *cmd);
+static void coproc_get_job_fini(void);
+static int coproc_get_job_batch(char **hosts, char **jobs, size_t count);
+
 static const char *execd_spool_path = "/share/sge6.2/execd_spool";
 static int execd_spool_get_job(const char *host, char *job, size_t job_size);
+static int execd_spool_job_map(void (*set_job)(const char *host, const char *job));
 
 static const char *job_map_cmd = NULL;
-static int external_job_map(void);
+static int external_job_map(void (*set_job)(const char *host, const char *job));
+
+/* The built in lookups, as plugins. */
+static const struct lltop_plugin getnameinfo_plugin = {
+  .p_abi = LLTOP_PLUGIN_ABI,
+  .p_name = "getnameinfo",
+  .p_get_host = &getnameinfo_get_host,
+};
+
+static const struct lltop_plugin external_get_host_plugin = {
+  .p_abi = LLTOP_PLUGIN_ABI,
+  .p_name = "external get-host",
+  .p_get_host = &external_get_host,
+};
+
+static const struct lltop_plugin coproc_get_host_plugin = {
+  .p_abi = LLTOP_PLUGIN_ABI,
+  .p_name = "co-process get-host",
+  .p_init = &coproc_get_host_init,
+  .p_fini = &coproc_get_host_fini,
+  .p_get_host_batch = &coproc_get_host_batch,
+};
+
+static const struct lltop_plugin execd_spool_plugin = {
+  .p_abi = LLTOP_PLUGIN_ABI,
+  .p_name = "execd_spool",
+  .p_get_job = &execd_spool_get_job,
+};
+
+static const struct lltop_plugin execd_spool_job_map_plugin = {
+  .p_abi = LLTOP_PLUGIN_ABI,
+  .p_name = "execd_spool job-map",
+  .p_job_map = &execd_spool_job_map,
+};
+
+static const struct lltop_plugin external_get_job_plugin = {
+  .p_abi = LLTOP_PLUGIN_ABI,
+  .p_name = "external get-job",
+  .p_get_job = &external_get_job,
+};
+
+static const struct lltop_plugin coproc_get_job_plugin = {
+  .p_abi = LLTOP_PLUGIN_ABI,
+  .p_name = "co-process get-job",
+  .p_init = &coproc_get_job_init,
+  .p_fini = &coproc_get_job_fini,
+  .p_get_job_batch = &coproc_get_job_batch,
+};
+
+static const struct lltop_plugin external_job_map_plugin = {
+  .p_abi = LLTOP_PLUGIN_ABI,
+  .p_name = "external job-map",
+  .p_job_map = &external_job_map,
+};
+
+static const char *plugin_path = NULL;
+static const struct lltop_plugin *load_plugin(const char *path, const char **arg);
+static int use_plugin(const struct lltop_plugin *plugin, const char *arg);
+
+/* Plugins in use, for lltop_fini(). */
+static const struct lltop_plugin *plugin_vec[4];
+static int plugin_count = 0;
+
+static const struct lltop_plugin *job_map_plugin = NULL;
+static int plugin_job_map(void);
 
 static int print_header = 1;
-static int print_limit = INT_MAX;
 
 static int usage(void)
 {
@@ -74,11 +187,32 @@ static int usage(void)
           "  -j, --get-job=COMMAND    use COMMAND for job lookup\n"
           "  -l, --server-list        report load on servers given as arguments\n"
           "  -m, --job-map=COMMAND    use COMMAND to get job map\n"
-          "  -n, --limit=NUMBER       limit output to NUMBER jobs\n"
+          "  -n, --limit=NUMBER       limit output to NUMBER jobs, add up the rest as OTHER\n"
+          "      --rank=KEY,...       rank jobs by each KEY of wr, rd, reqs, total (wr)\n"
           "      --no-header          do not display header\n"
           "      --lltop-serv=PATH    use lltop-serv at PATH on servers\n"
           "      --remote-shell=PATH  use remote shell at PATH to execute lltop-serv\n"
+          "      --serv-socket=PATH   ask lltop-serv --agent at PATH on servers, if up\n"
+          "      --serv-baseline=PATH keep lltop-serv totals in PATH on servers for next time\n"
+          "      --serv-share=DIR     share lltop-serv scans with other lltops through DIR\n"
           "      --execd-spool=PATH   use execd_spool directory PATH for job lookup\n"
+          "      --job-stats          report Lustre job_stats jobids, no job lookup\n"
+          "      --format=FORMAT      have lltop-serv send text (default) or binary output\n"
+          "      --server-stats       print bytes, records, and timing per server to stderr\n"
+          "      --deadline=SECONDS   give up on servers SECONDS after the interval ends\n"
+          "      --max-sessions=N     have at most N ssh sessions connecting at once\n"
+          "      --start-rate=N       start at most N ssh sessions per second, ramping up\n"
+          "      --persist[=SECONDS]  keep ssh sessions open for reuse for SECONDS (600)\n"
+          "      --resolvers=N        resolve up to N client addresses at once (16)\n"
+          "      --cache=PATH         keep host and job lookups in cache file PATH\n"
+          "      --cache-ttl=HOST,JOB keep hosts HOST seconds (86400) and jobs JOB (60)\n"
+          "      --share[=DIR]        share tables with other lltops through DIR\n"
+          "      --share-age=SECONDS  reuse shared tables up to SECONDS old (the interval)\n"
+          "      --relay=HOST,...     split servers among relay HOSTs running lltop --emit\n"
+          "      --relay-lltop=PATH   use lltop at PATH on relays\n"
+          "      --emit               print per-client totals for another lltop, no table\n"
+          "      --ready              like lltop-serv --ready (for relays)\n"
+          "      --plugin=PATH[:ARG]  use lookups from plugin PATH, passing it ARG\n"
           "\n"
           /* TODO Describe function, document default argument values. */
           /* TODO "Report lltop bugs to ...\n" */
@@ -88,6 +222,7 @@ static int usage(void)
 
 int lltop_config(int argc, char *argv[], char ***serv_list, int *serv_count)
 {
+  const struct lltop_plugin *host_plugin = NULL, *job_plugin = NULL, *map_plugin = NULL;
   struct option opts[] = {
     { "fqdn",         0, 0, 'f' }, /* Set getnameinfo_use_fqdn. */
     { "get-host",     1, 0, 'g' }, /* get_host_path */
@@ -96,11 +231,32 @@ int lltop_config(int argc, char *argv[], char ***serv_list, int *serv_count)
     { "get-job",      1, 0, 'j' }, /* get_job_path */
     { "server-list",  0, 0, 'l' }, /* Set serv_list_from_args. */
     { "job-map",      1, 0, 'm' }, /* job_map_cmd */
-    { "limit",        1, 0, 'n' }, /* print_limit */
+    { "limit",        1, 0, 'n' }, /* lltop_limit */
     { "no-header",    0, &print_header, 0 }, /* Unset print_header. */
     { "lltop-serv",   1, 0, 256 }, /* lltop_serv_path */
     { "remote-shell", 1, 0, 257 }, /* lltop_ssh_path */
     { "execd-spool",  1, 0, 258 },
+    { "job-stats",    0, &lltop_job_stats, 1 }, /* Set lltop_job_stats. */
+    { "format",       1, 0, 259 }, /* lltop_binary */
+    { "server-stats", 0, &lltop_serv_stats, 1 }, /* Set lltop_serv_stats. */
+    { "deadline",     1, 0, 260 }, /* lltop_deadline */
+    { "max-sessions", 1, 0, 261 }, /* lltop_max_sessions */
+    { "start-rate",   1, 0, 262 }, /* lltop_start_rate */
+    { "persist",      2, 0, 263 }, /* lltop_persist */
+    { "relay",        1, 0, 264 }, /* lltop_relay_list */
+    { "relay-lltop",  1, 0, 265 }, /* lltop_relay_path */
+    { "emit",         0, &lltop_emit, 1 }, /* Set lltop_emit. */
+    { "ready",        0, &lltop_ready, 1 }, /* Set lltop_ready. */
+    { "resolvers",    1, 0, 266 }, /* lltop_resolvers */
+    { "cache",        1, 0, 267 }, /* lltop_cache_path */
+    { "cache-ttl",    1, 0, 268 }, /* lltop_host_ttl, lltop_job_ttl */
+    { "plugin",       1, 0, 269 }, /* plugin_path */
+    { "rank",         1, 0, 270 }, /* lltop_rank_vec */
+    { "serv-socket",  1, 0, 271 }, /* lltop_serv_socket */
+    { "serv-baseline", 1, 0, 272 }, /* lltop_serv_baseline */
+    { "serv-share",   1, 0, 273 }, /* lltop_serv_share */
+    { "share",        2, 0, 274 }, /* lltop_share, lltop_share_dir */
+    { "share-age",    1, 0, 275 }, /* lltop_share_age */
     { 0, 0, 0, 0, },
   };
 
@@ -112,7 +268,7 @@ int lltop_config(int argc, char *argv[], char ***serv_list, int *serv_count)
       break;
     case 'g':
       get_host_path = optarg;
-      lltop_get_host = &external_get_host;
+      host_plugin = &external_get_host_plugin;
       break;
     case 'h':
       usage();
@@ -124,17 +280,17 @@ int lltop_config(int argc, char *argv[], char ***serv_list, int *serv_count)
       break;
     case 'j':
       get_job_path = optarg;
-      lltop_get_job = &external_get_job;
+      job_plugin = &external_get_job_plugin;
       break;
     case 'l':
       serv_list_from_args = 1;
       break;
     case 'm':
       job_map_cmd = optarg;
-      lltop_job_map = &external_job_map;
+      map_plugin = &external_job_map_plugin;
       break;
     case 'n':
-      print_limit = atoi(optarg);
+      lltop_limit = atoi(optarg);
       break;
     case 256:
       lltop_serv_path = optarg;
@@ -144,7 +300,80 @@ int lltop_config(int argc, char *argv[], char ***serv_list, int *serv_count)
       break;
     case 258:
       execd_spool_path = optarg;
-      lltop_get_job = &execd_spool_get_job;
+      map_plugin = &execd_spool_job_map_plugin;
+      break;
+    case 259:
+      if (strcmp(optarg, "binary") == 0)
+        lltop_binary = 1;
+      else if (strcmp(optarg, "text") == 0)
+        lltop_binary = 0;
+      else
+        FATAL("invalid format \"%s\"\n", optarg);
+      break;
+    case 260:
+      lltop_deadline = atoi(optarg);
+      if (lltop_deadline <= 0)
+        FATAL("invalid deadline \"%s\"\n", optarg);
+      break;
+    case 261:
+      lltop_max_sessions = atoi(optarg);
+      if (lltop_max_sessions <= 0)
+        FATAL("invalid number of sessions \"%s\"\n", optarg);
+      break;
+    case 262:
+      lltop_start_rate = atoi(optarg);
+      if (lltop_start_rate <= 0)
+        FATAL("invalid start rate \"%s\"\n", optarg);
+      break;
+    case 263:
+      lltop_persist = optarg != NULL ? atoi(optarg) : DEFAULT_LLTOP_PERSIST;
+      if (lltop_persist <= 0)
+        FATAL("invalid persist time \"%s\"\n", optarg);
+      break;
+    case 264:
+      if (get_relay_list(optarg) < 0)
+        FATAL("invalid relay list \"%s\"\n", optarg);
+      break;
+    case 265:
+      lltop_relay_path = optarg;
+      break;
+    case 266:
+      lltop_resolvers = atoi(optarg);
+      if (lltop_resolvers <= 0)
+        FATAL("invalid number of resolvers \"%s\"\n", optarg);
+      break;
+    case 267:
+      lltop_cache_path = optarg;
+      break;
+    case 268:
+      if (sscanf(optarg, "%d,%d", &lltop_host_ttl, &lltop_job_ttl) != 2 ||
+          lltop_host_ttl <= 0 || lltop_job_ttl <= 0)
+        FATAL("invalid cache TTLs \"%s\"\n", optarg);
+      break;
+    case 269:
+      plugin_path = optarg;
+      break;
+    case 270:
+      if (get_rank_list(optarg) < 0)
+        FATAL("invalid rank list \"%s\"\n", optarg);
+      break;
+    case 271:
+      lltop_serv_socket = optarg;
+      break;
+    case 272:
+      lltop_serv_baseline = optarg;
+      break;
+    case 273:
+      lltop_serv_share = optarg;
+      break;
+    case 274:
+      lltop_share = 1;
+      lltop_share_dir = optarg;
+      break;
+    case 275:
+      lltop_share_age = atoi(optarg);
+      if (lltop_share_age < 0)
+        FATAL("invalid share age \"%s\"\n", optarg);
       break;
     case '?':
       fprintf(stderr, "Try `lltop --help' for more information.\n");
@@ -163,17 +392,151 @@ int lltop_config(int argc, char *argv[], char ***serv_list, int *serv_count)
     FATAL("cannot get server list for %s: %m\n", argv[optind]);
   }
 
+  /* Job stats are already by job, and relays leave it to us. */
+  if (lltop_job_stats || lltop_emit)
+    return 0;
+
+  /* A plugin replaces the built in lookups that it provides. */
+  const char *plugin_arg = NULL;
+  const struct lltop_plugin *plugin = NULL;
+  if (plugin_path != NULL) {
+    plugin = load_plugin(plugin_path, &plugin_arg);
+    if (plugin == NULL)
+      FATAL("cannot load plugin `%s'\n", plugin_path);
+
+    if (plugin->p_get_host != NULL || plugin->p_get_host_batch != NULL)
+      host_plugin = plugin;
+    if (plugin->p_get_job != NULL || plugin->p_get_job_batch != NULL)
+      job_plugin = plugin;
+    if (plugin->p_job_map != NULL)
+      map_plugin = plugin;
+  }
+
   /* BLECH. */
-  if (lltop_get_host == NULL)
-    lltop_get_host = &getnameinfo_get_host;
+  if (host_plugin == NULL)
+    host_plugin = &getnameinfo_plugin;
 
   /* BLECH. */
-  if (lltop_get_job == NULL && lltop_job_map == NULL)
-    lltop_get_job = &execd_spool_get_job;
+  if (job_plugin == NULL && map_plugin == NULL)
+    job_plugin = &execd_spool_plugin;
+
+  if (plugin != NULL && use_plugin(plugin, plugin_arg) < 0)
+    FATAL("cannot initialize plugin `%s'\n", plugin->p_name);
+
+  /* Run external commands that speak the co-process protocol once
+   * and send them everything in one batch, rather than running them
+   * once per lookup. */
+  if (host_plugin == &external_get_host_plugin &&
+      use_plugin(&coproc_get_host_plugin, get_host_path) == 0)
+    host_plugin = &coproc_get_host_plugin;
+
+  if (job_plugin == &external_get_job_plugin &&
+      use_plugin(&coproc_get_job_plugin, get_job_path) == 0)
+    job_plugin = &coproc_get_job_plugin;
+
+  /* The rest are in use already or have no p_init, so can't fail. */
+  use_plugin(host_plugin, NULL);
+  if (job_plugin != NULL)
+    use_plugin(job_plugin, NULL);
+  if (map_plugin != NULL)
+    use_plugin(map_plugin, NULL);
+
+  return 0;
+}
+
+static const struct lltop_plugin *load_plugin(const char *path, const char **arg)
+{
+  /* Open the plugin at path, which may be followed by ":ARG", and
+   * check that we speak its ABI.  The plugin stays loaded for good. */
+  const struct lltop_plugin *plugin;
+  char *file = strdup(path);
+  void *handle;
+
+  if (file == NULL)
+    FATAL("out of memory\n");
+
+  char *colon = strchr(file, ':');
+  if (colon != NULL) {
+    *colon = 0;
+    *arg = path + (colon - file) + 1;
+  }
+
+  handle = dlopen(file, RTLD_NOW | RTLD_LOCAL);
+  if (handle == NULL) {
+    ERROR("%s\n", dlerror());
+    free(file);
+    return NULL;
+  }
+
+  plugin = dlsym(handle, LLTOP_PLUGIN_SYMBOL);
+  if (plugin == NULL) {
+    ERROR("%s\n", dlerror());
+    goto err;
+  }
+
+  if (plugin->p_abi != LLTOP_PLUGIN_ABI) {
+    ERROR("plugin `%s' has ABI version %d, expected %d\n", file,
+          plugin->p_abi, LLTOP_PLUGIN_ABI);
+    goto err;
+  }
+
+  TRACE("loaded plugin `%s' from `%s'\n", plugin->p_name, file);
+  free(file);
+  return plugin;
+
+ err:
+  dlclose(handle);
+  free(file);
+  return NULL;
+}
+
+static int use_plugin(const struct lltop_plugin *plugin, const char *arg)
+{
+  /* Initialize plugin and point the lookup hooks at whatever it
+   * provides.  Does nothing for a plugin that's in use already. */
+  int i;
+  for (i = 0; i < plugin_count; i++)
+    if (plugin_vec[i] == plugin)
+      return 0;
+
+  if (plugin->p_init != NULL && (*plugin->p_init)(arg) < 0)
+    return -1;
+
+  plugin_vec[plugin_count++] = plugin;
+
+  if (plugin->p_get_host != NULL || plugin->p_get_host_batch != NULL) {
+    lltop_get_host = plugin->p_get_host;
+    lltop_get_host_batch = plugin->p_get_host_batch;
+  }
+
+  if (plugin->p_get_job != NULL || plugin->p_get_job_batch != NULL) {
+    lltop_get_job = plugin->p_get_job;
+    lltop_get_job_batch = plugin->p_get_job_batch;
+  }
+
+  if (plugin->p_job_map != NULL) {
+    job_map_plugin = plugin;
+    lltop_job_map = &plugin_job_map;
+  }
 
   return 0;
 }
 
+static int plugin_job_map(void)
+{
+  return (*job_map_plugin->p_job_map)(&lltop_set_job);
+}
+
+void lltop_fini(void)
+{
+  /* Called once lltop is done with the lookup hooks. */
+  while (plugin_count > 0) {
+    const struct lltop_plugin *plugin = plugin_vec[--plugin_count];
+    if (plugin->p_fini != NULL)
+      (*plugin->p_fini)();
+  }
+}
+
 static int get_serv_list(const char *fs_name, char ***serv_list, int *serv_count)
 {
   /* Get the server list for filesystem named fs_name and store in
@@ -221,6 +584,55 @@ static int get_serv_list(const char *fs_name, char ***serv_list, int *serv_count
   return 0;
 }
 
+static int get_relay_list(const char *arg)
+{
+  /* Split the comma separated list arg into lltop_relay_list. */
+  char *list = strdup(arg), *relay, *save;
+
+  if (list == NULL)
+    FATAL("out of memory\n");
+
+  lltop_relay_list = alloc((strlen(list) / 2 + 1) * sizeof(char *));
+  lltop_relay_count = 0;
+
+  for (relay = strtok_r(list, ",", &save); relay != NULL;
+       relay = strtok_r(NULL, ",", &save))
+    lltop_relay_list[lltop_relay_count++] = relay;
+
+  return lltop_relay_count > 0 ? 0 : -1;
+}
+
+static int get_rank_list(const char *arg)
+{
+  /* Split the comma separated list of rank keys arg into
+   * lltop_rank_vec. */
+  char *list = strdup(arg), *key, *save;
+  int i, rc = 0;
+
+  if (list == NULL)
+    FATAL("out of memory\n");
+
+  lltop_rank_count = 0;
+
+  for (key = strtok_r(list, ",", &save); key != NULL;
+       key = strtok_r(NULL, ",", &save)) {
+    for (i = 0; i < LLTOP_NR_RANKS; i++)
+      if (strcmp(key, lltop_rank_names[i]) == 0)
+        break;
+
+    if (i == LLTOP_NR_RANKS || lltop_rank_count == LLTOP_NR_RANKS) {
+      rc = -1;
+      break;
+    }
+
+    lltop_rank_vec[lltop_rank_count++] = i;
+  }
+
+  free(list);
+
+  return lltop_rank_count > 0 ? rc : -1;
+}
+
 void lltop_free_serv_list(char **serv_list, int serv_count)
 {
   /* Clean up the server list gotten by the last function.  Utterly
@@ -235,6 +647,13 @@ void lltop_free_serv_list(char **serv_list, int serv_count)
   free(serv_list);
 }
 
+void lltop_print_rank(FILE *file, int i, const char *key)
+{
+  /* Called before each ranking when there is more than one, i
+   * counting from 0. */
+  fprintf(file, "%sTOP %s\n", i > 0 ? "\n" : "", key);
+}
+
 void lltop_print_header(FILE *file)
 {
   /* Called once before lltop_print_name_stats(). This is your chance
@@ -244,20 +663,35 @@ void lltop_print_header(FILE *file)
     fprintf(file, "%-16s %8s %8s %8s\n", "JOBID", "WR_MB", "RD_MB", "REQS");
 }
 
-void lltop_print_name_stats(FILE *file, const char *name, long wr_B, long rd_B, long reqs)
+int lltop_show_name_stats(long wr_B, long rd_B, long reqs)
 {
-  /* Called for each job to be output by lltop.  Note we convert bytes
-   * to MB, and that we don't print if all values would be zero. */
-
-  if (print_limit <= 0)
-    return;
+  /* Return nonzero if lltop_print_name_stats() would print a line for
+   * these stats, so that only those count against lltop_limit.  We
+   * don't print if all values would be zero. */
+  return (wr_B >> 20) != 0 || (rd_B >> 20) != 0 || reqs != 0;
+}
 
+void lltop_print_name_stats(FILE *file, const char *name, long wr_B, long rd_B, long reqs)
+{
+  /* Called for each of the top lltop_limit jobs, in order, and then
+   * for an OTHER job holding the rest if there is any.  Note we
+   * convert bytes to MB. */
   long wr_MB = wr_B >> 20, rd_MB = rd_B >> 20;
 
-  if (wr_MB != 0 || rd_MB != 0 || reqs != 0) {
+  if (lltop_show_name_stats(wr_B, rd_B, reqs))
     fprintf(file, "%-16s %8lu %8lu %8lu\n", name, wr_MB, rd_MB, reqs);
-    print_limit--;
-  }
+}
+
+void lltop_print_missed(FILE *file, const char **serv_list, int serv_count, int total_count)
+{
+  /* Called after the stats if some servers missed the deadline, so
+   * that nobody mistakes a partial table for a complete one. */
+  int i;
+
+  fprintf(file, "%d of %d servers missed the deadline:", serv_count, total_count);
+  for (i = 0; i < serv_count; i++)
+    fprintf(file, " %s", serv_list[i]);
+  fprintf(file, "\n");
 }
 
 static int command(const char *path, const char *arg, char *buf, size_t buf_size)
@@ -342,6 +776,36 @@ static int external_get_job(const char *host, char *job, size_t job_size)
   return command(get_job_path, host, job, job_size);
 }
 
+static int coproc_get_host_init(const char *cmd)
+{
+  return coproc_start(&get_host_coproc, cmd);
+}
+
+static void coproc_get_host_fini(void)
+{
+  coproc_stop(&get_host_coproc);
+}
+
+static int coproc_get_host_batch(char **addrs, char **hosts, size_t count)
+{
+  return coproc_batch(&get_host_coproc, addrs, hosts, count);
+}
+
+static int coproc_get_job_init(const char *cmd)
+{
+  return coproc_start(&get_job_coproc, cmd);
+}
+
+static void coproc_get_job_fini(void)
+{
+  coproc_stop(&get_job_coproc);
+}
+
+static int coproc_get_job_batch(char **hosts, char **jobs, size_t count)
+{
+  return coproc_batch(&get_job_coproc, hosts, jobs, count);
+}
+
 static int execd_spool_get_job(const char *host, char *job, size_t job_size)
 {
   /* Find jobname for host and store in buffer job of size job_size.
@@ -389,7 +853,99 @@ static int execd_spool_get_job(const char *host, char *job, size_t job_size)
   return rc;
 }
 
-static int external_job_map(void)
+/* For execd_spool_job_map(), see getdents64(2). */
+struct linux_dirent64 {
+  uint64_t       d_ino;
+  int64_t        d_off;
+  unsigned short d_reclen;
+  unsigned char  d_type;
+  char           d_name[0];
+};
+
+#define EXECD_SPOOL_HOST_BUF_SIZE (1 << 20)
+#define EXECD_SPOOL_JOB_BUF_SIZE 4096
+
+static int execd_spool_first_job(int jobs_fd, char *buf, char *job, size_t job_size)
+{
+  /* Store the name of the first job directory in the active_jobs
+   * directory jobs_fd, less its '.<array_task>' suffix, in job.
+   * Return 0 if job was written, -1 otherwise. */
+  int nr;
+
+  while ((nr = syscall(SYS_getdents64, jobs_fd, buf, EXECD_SPOOL_JOB_BUF_SIZE)) > 0) {
+    char *pos = buf, *end = buf + nr;
+    for (; pos < end; pos += ((struct linux_dirent64 *) pos)->d_reclen) {
+      struct linux_dirent64 *de = (struct linux_dirent64 *) pos;
+      if (de->d_type == DT_DIR && de->d_name[0] != '.') {
+        snprintf(job, job_size, "%s", chop(de->d_name, '.'));
+        return 0;
+      }
+    }
+  }
+
+  return -1;
+}
+
+static int execd_spool_job_map(void (*set_job)(const char *host, const char *job))
+{
+  /* Like execd_spool_get_job(), but for every host in the execd_spool
+   * directory in one sweep.  We read the spool directory in big
+   * chunks with getdents64() and open each active_jobs directory
+   * relative to it, so there are no path lookups from the root and
+   * no per-host allocations. */
+  char *host_buf = NULL, *job_buf = NULL;
+  char jobs_path[NAME_MAX + 1 + 20];
+  char job[MAXNAME + 1];
+  int spool_fd, nr, rc = -1;
+
+  spool_fd = open(execd_spool_path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+  if (spool_fd < 0) {
+    ERROR("cannot open `%s': %m\n", execd_spool_path);
+    return -1;
+  }
+
+  host_buf = alloc(EXECD_SPOOL_HOST_BUF_SIZE);
+  job_buf = alloc(EXECD_SPOOL_JOB_BUF_SIZE);
+
+  while ((nr = syscall(SYS_getdents64, spool_fd, host_buf, EXECD_SPOOL_HOST_BUF_SIZE)) > 0) {
+    char *pos = host_buf, *end = host_buf + nr;
+    for (; pos < end; pos += ((struct linux_dirent64 *) pos)->d_reclen) {
+      struct linux_dirent64 *de = (struct linux_dirent64 *) pos;
+      const char *host = de->d_name;
+      int jobs_fd;
+
+      if (host[0] == '.' || (de->d_type != DT_DIR && de->d_type != DT_UNKNOWN))
+        continue;
+
+      snprintf(jobs_path, sizeof(jobs_path), "%s/active_jobs", host);
+      jobs_fd = openat(spool_fd, jobs_path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+      if (jobs_fd < 0) {
+        /* Not every host need have an active_jobs directory. */
+        if (errno != ENOENT && errno != ENOTDIR)
+          ERROR("cannot open `%s/%s': %m\n", execd_spool_path, jobs_path);
+        continue;
+      }
+
+      if (execd_spool_first_job(jobs_fd, job_buf, job, sizeof(job)) == 0)
+        (*set_job)(host, job);
+
+      close(jobs_fd);
+    }
+  }
+
+  if (nr < 0)
+    ERROR("cannot read `%s': %m\n", execd_spool_path);
+  else
+    rc = 0;
+
+  free(job_buf);
+  free(host_buf);
+  close(spool_fd);
+
+  return rc;
+}
+
+static int external_job_map(void (*set_job)(const char *host, const char *job))
 {
   int pclose_rc = -1;
   FILE *pipe = NULL;
@@ -413,7 +969,7 @@ static int external_job_map(void)
       continue;
     }
 
-    lltop_set_job(host, job);
+    (*set_job)(host, job);
   }
   free(line);
 
@@ -3,16 +3,62 @@
 #include <stdio.h>
 
 extern int lltop_intvl;
+extern int lltop_limit;
+
+/* Keys for --rank. */
+enum {
+  LLTOP_RANK_WR,
+  LLTOP_RANK_RD,
+  LLTOP_RANK_REQS,
+  LLTOP_RANK_TOTAL,
+  LLTOP_NR_RANKS,
+};
+
+extern const char *lltop_rank_names[LLTOP_NR_RANKS];
+extern int lltop_rank_vec[LLTOP_NR_RANKS];
+extern int lltop_rank_count;
+extern int lltop_job_stats;
+extern int lltop_binary;
+extern int lltop_serv_stats;
+extern int lltop_deadline;
+extern int lltop_max_sessions;
+extern int lltop_start_rate;
+extern int lltop_persist;
+extern int lltop_resolvers;
+extern const char *lltop_cache_path;
+extern int lltop_host_ttl;
+extern int lltop_job_ttl;
+extern int lltop_share;
+extern const char *lltop_share_dir;
+extern int lltop_share_age;
+extern int lltop_emit;
+extern int lltop_ready;
+extern char **lltop_relay_list;
+extern int lltop_relay_count;
+extern const char *lltop_relay_path;
 extern const char *lltop_ssh_path;
 extern const char *lltop_serv_path;
+extern const char *lltop_serv_socket;
+extern const char *lltop_serv_baseline;
+extern const char *lltop_serv_share;
 extern int (*lltop_get_host)(const char *addr, char *host, size_t host_size);
 extern int (*lltop_get_job)(const char *host, char *job, size_t job_size);
 extern int (*lltop_job_map)(void);
 
+/* Batch lookups, set instead of (in addition to) the hooks above when
+ * they can do many lookups at once.  Set vals[i] to the malloc()ed
+ * host or job for keys[i], or to NULL if there is none. */
+extern int (*lltop_get_host_batch)(char **addrs, char **hosts, size_t count);
+extern int (*lltop_get_job_batch)(char **hosts, char **jobs, size_t count);
+
 void lltop_set_job(const char *host, const char *job);
 int lltop_config(int argc, char *argv[], char ***serv_list, int *serv_count);
+void lltop_fini(void);
 void lltop_free_serv_list(char **serv_list, int serv_count);
+void lltop_print_rank(FILE *file, int i, const char *key);
 void lltop_print_header(FILE *file);
+int lltop_show_name_stats(long wr_B, long rd_B, long reqs);
 void lltop_print_name_stats(FILE *file, const char *name, long wr_B, long rd_B, long reqs);
+void lltop_print_missed(FILE *file, const char **serv_list, int serv_count, int total_count);
 
 #endif
@@ -22,6 +22,7 @@
 #include "lltop.h"
 #include "dict.h"
 #include "list.h"
+#include "tok.h"
 
 const char *job_mapper_cmd = "cat /tmp/lltop/mapper-fifo";
 const char *nid_file_path = "/tmp/lltop/client-nids";
@@ -164,14 +165,14 @@ ssize_t rx_buf_read(int fd, struct rx_buf *rb)
   return nr_read;
 }
 
-char *rx_buf_iter(struct rx_buf *rb)
+char *rx_buf_iter(struct rx_buf *rb, size_t *len)
 {
   char *pos, *sep, *end;
 
  again:
   pos = rb->r_buf + rb->r_seen;
   end = rb->r_buf + rb->r_count;
-  sep = memchr(pos, '\n', end - pos); /* XXX '\n' */
+  sep = tok_line(pos, end); /* XXX '\n' */
   
   if (sep == NULL)
     return NULL;
@@ -184,6 +185,8 @@ char *rx_buf_iter(struct rx_buf *rb)
   }
 
   *sep = 0;
+  if (len != NULL)
+    *len = sep - pos;
 
   return pos;
 }
@@ -366,7 +369,7 @@ static void job_mapper_io_cb(EV_P_ ev_io *w, int revents)
   }
 
   char *msg, *cli_name, *job_name;
-  while ((msg = rx_buf_iter(rb)) != NULL) {
+  while ((msg = rx_buf_iter(rb, NULL)) != NULL) {
     cli_name = wsep(&msg);
     job_name = wsep(&msg);
 
@@ -503,17 +506,21 @@ static void serv_error(EV_P_ struct serv_struct *serv)
   serv_disconnect(EV_A_ serv);
 }
 
-static void serv_msg(struct serv_struct *serv, char *msg)
+static void serv_msg(struct serv_struct *serv, char *msg, size_t len)
 {
-  char *cli_nid = wsep(&msg);
-  if (cli_nid == NULL || msg == NULL)
-    return;
-
-  /* TODO Use NR_STATS, strtol(). */
+  char *field[1 + NR_STATS];
   long stats[NR_STATS];
-  if (sscanf(msg, "%ld %ld %ld", &stats[0], &stats[1], &stats[2]) != 3)
+  int i;
+
+  if (tok_split(msg, len, field, 1 + NR_STATS) != 1 + NR_STATS)
     return;
 
+  for (i = 0; i < NR_STATS; i++)
+    if (tok_long(field[1 + i], &stats[i]) < 0)
+      return;
+
+  char *cli_nid = field[0];
+
   struct client_struct *cli = client_lookup_by_nid(cli_nid, 1);
   if (cli == NULL)
     OOM();
@@ -581,8 +588,9 @@ static void serv_io_cb(EV_P_ ev_io *w, int revents)
   }
 
   char *msg;
-  while ((msg = rx_buf_iter(rb)) != NULL)
-    serv_msg(serv, msg);
+  size_t len;
+  while ((msg = rx_buf_iter(rb, &len)) != NULL)
+    serv_msg(serv, msg, len);
 }
 
 static void serv_timer_cb(EV_P_ ev_timer *w, int revents)
@@ -9,6 +9,23 @@
 
 #define MAXNAME 1024
 #define DEFAULT_LLTOP_INTVL 10
+#define DEFAULT_LLTOP_PERSIST 600
+#define DEFAULT_LLTOP_RESOLVERS 16
+#define DEFAULT_LLTOP_HOST_TTL 86400
+#define DEFAULT_LLTOP_JOB_TTL 60
+#define DEFAULT_LLTOP_SHARE_DIR "/run/lltop"
+
+/* lltop-serv --ready handshake: lltop-serv writes SERV_READY_LINE on
+   stdout when it starts, and waits for SERV_GO_LINE on stdin before
+   taking its first sample. */
+#define SERV_READY_LINE "#ready\n"
+#define SERV_GO_LINE "go\n"
+
+/* With --format=binary, lltop-serv (or a relay) writes
+   SERV_BINARY_LINE before its first frame.  lltop reads anything else
+   from that server as text, which is what an lltop-serv that doesn't
+   know binary output sends. */
+#define SERV_BINARY_LINE "#binary 1\n"
 
 #ifdef DEBUG
 #include <sys/time.h>
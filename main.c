@@ -19,162 +19,1394 @@
 #define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include "lltop.h"
+#include "dict.h"
 #include "hooks.h"
-#include "rbtree.h"
+#include "nid.h"
+#include "rcache.h"
+#include "tcache.h"
+#include "tok.h"
+#include "wire.h"
 
+/* Stats are kept in a dense array, indexed by the id that
+ * get_name_stats() interns each name (job, host, or address) under. */
 struct name_stats {
-  struct rb_node ns_node;
   long ns_wr, ns_rd, ns_reqs;
-  char ns_name[];
+  const char *ns_name;
 };
 
+struct name_id {
+  long ni_id;
+  char ni_name[];
+};
+
+static struct dict name_dict;
+static struct name_stats *name_stats_vec;
+static size_t name_stats_count, name_stats_size;
+
 struct cache_struct {
-  struct rb_node c_node;
-  struct name_stats *c_stats;
-  char c_name[];
+  long c_stats; /* name_stats id, or -1 for none yet. */
+  /* For addresses: raw counters, and what they are to be accounted
+   * under once resolved (see attribute_addrs()).  With --cache, also
+   * the host, and which lookups we made that the cache should learn. */
+  nid_t c_nid;
+  long c_wr, c_rd, c_reqs;
+  char *c_key;
+  char *c_host;
+  unsigned int c_have_nid:1, c_new_host:1, c_new_job:1, c_have_job:1;
+  char c_name[]; /* Address, or host for host_dict. */
 };
 
-struct rb_root addr_cache_root = RB_ROOT;
-struct rb_root host_cache_root = RB_ROOT;
-struct rb_root name_stats_root = RB_ROOT;
-int name_stats_count = 0;
+/* Clients are kept by NID, or, for names nid_parse() doesn't know,
+ * by address in addr_dict.  Either way they also go in addr_vec. */
+static struct nid_table addr_table;
+static struct dict addr_dict;
+static struct cache_struct **addr_vec;
+static size_t addr_count, addr_size;
+
+/* Hosts from the job map. */
+static struct dict host_dict;
 
-static struct cache_struct *lookup(struct rb_root *root, const char *name, int create)
+static inline struct cache_struct *key_cache(char *key)
 {
-  struct cache_struct *cache;
-  struct rb_node **link, *parent;
+  return (struct cache_struct *) (key - offsetof(struct cache_struct, c_name));
+}
 
-  link = &root->rb_node;
-  parent = NULL;
+static inline struct name_id *key_name_id(char *key)
+{
+  return (struct name_id *) (key - offsetof(struct name_id, ni_name));
+}
 
-  while (*link != NULL) {
-    cache = rb_entry(*link, struct cache_struct, c_node);
-    parent = *link;
+#ifdef DEBUG
+static void free_cache_key(void *key)
+{
+  free(key_cache(key));
+}
 
-    int cmp = strcmp(name, cache->c_name);
-    if (cmp < 0)
-      link = &((*link)->rb_left);
-    else if (cmp > 0)
-      link = &((*link)->rb_right);
-    else
-      return cache;
-  }
+static void free_name_id_key(void *key)
+{
+  free(key_name_id(key));
+}
+#endif
 
-  if (!create)
-    return NULL;
+static struct cache_struct *new_cache(const char *name)
+{
+  struct cache_struct *cache;
 
   cache = alloc(sizeof(*cache) + strlen(name) + 1);
   memset(cache, 0, sizeof(*cache));
-  rb_link_node(&cache->c_node, parent, link);
-  rb_insert_color(&cache->c_node, root);
+  cache->c_stats = -1;
   strcpy(cache->c_name, name);
   return cache;
 }
 
-static struct name_stats *get_name_stats(const char *name)
+static struct cache_struct *lookup(struct dict *dict, const char *name, int create)
 {
-  struct name_stats *stats;
-  struct rb_node **link, *parent;
+  hash_t hash = dict_strhash(name);
+  struct dict_entry *de = dict_entry_ref(dict, hash, name);
+  struct cache_struct *cache;
 
-  link = &name_stats_root.rb_node;
-  parent = NULL;
+  if (de->d_key != NULL)
+    return key_cache(de->d_key);
 
-  while (*link != NULL) {
-    stats = rb_entry(*link, struct name_stats, ns_node);
-    parent = *link;
+  if (!create)
+    return NULL;
 
-    int cmp = strcmp(name, stats->ns_name);
-    if (cmp < 0)
-      link = &((*link)->rb_left);
-    else if (cmp > 0)
-      link = &((*link)->rb_right);
-    else
-      return stats;
+  cache = new_cache(name);
+  if (dict_entry_set(dict, de, hash, cache->c_name) < 0)
+    FATAL("out of memory\n");
+
+  return cache;
+}
+
+static long get_name_stats(const char *name)
+{
+  hash_t hash = dict_strhash(name);
+  struct dict_entry *de = dict_entry_ref(&name_dict, hash, name);
+  struct name_id *ni;
+
+  if (de->d_key != NULL)
+    return key_name_id(de->d_key)->ni_id;
+
+  ni = alloc(sizeof(*ni) + strlen(name) + 1);
+  ni->ni_id = name_stats_count;
+  strcpy(ni->ni_name, name);
+
+  if (dict_entry_set(&name_dict, de, hash, ni->ni_name) < 0)
+    FATAL("out of memory\n");
+
+  if (name_stats_count == name_stats_size) {
+    name_stats_size = name_stats_size > 0 ? 2 * name_stats_size : 64;
+    name_stats_vec = realloc(name_stats_vec, name_stats_size * sizeof(name_stats_vec[0]));
+    if (name_stats_vec == NULL)
+      FATAL("out of memory\n");
   }
 
-  stats = alloc(sizeof(*stats) + strlen(name) + 1);
-  memset(stats, 0, sizeof(*stats));
-  rb_link_node(&stats->ns_node, parent, link);
-  rb_insert_color(&stats->ns_node, &name_stats_root);
-  strcpy(stats->ns_name, name);
-  name_stats_count++;
+  memset(&name_stats_vec[name_stats_count], 0, sizeof(name_stats_vec[0]));
+  name_stats_vec[name_stats_count].ns_name = ni->ni_name;
+
+  return name_stats_count++;
+}
+
+static void add_stats(long id, long wr, long rd, long reqs)
+{
+  struct name_stats *stats = &name_stats_vec[id];
 
-  return stats;
+  stats->ns_wr += wr;
+  stats->ns_rd += rd;
+  stats->ns_reqs += reqs;
 }
 
 void lltop_set_job(const char *host, const char *job)
 {
   struct cache_struct *cache;
 
-  cache = lookup(&host_cache_root, host, 1);
+  cache = lookup(&host_dict, host, 1);
   cache->c_stats = get_name_stats(job);
 }
 
-static void account(const char *addr, long wr, long rd, long reqs)
+static struct cache_struct *add_addr(struct cache_struct *addr_cache)
 {
-  struct name_stats *stats = NULL;
+  if (addr_count == addr_size) {
+    addr_size = addr_size > 0 ? 2 * addr_size : 256;
+    addr_vec = realloc(addr_vec, addr_size * sizeof(addr_vec[0]));
+    if (addr_vec == NULL)
+      FATAL("out of memory\n");
+  }
+
+  addr_vec[addr_count++] = addr_cache;
+  return addr_cache;
+}
+
+static void account_nid(nid_t nid, long wr, long rd, long reqs)
+{
+  /* Add up by client for now, and resolve them all at once when
+   * we're done reading. */
+  struct nid_entry *ne = nid_table_ref(&addr_table, nid);
   struct cache_struct *addr_cache;
-  struct cache_struct *host_cache;
+
+  if (ne == NULL)
+    FATAL("out of memory\n");
+
+  addr_cache = ne->ne_ptr;
+  if (addr_cache == NULL) {
+    char addr[64];
+    nid_format_addr(nid, addr, sizeof(addr));
+    addr_cache = ne->ne_ptr = add_addr(new_cache(addr));
+    addr_cache->c_nid = nid;
+    addr_cache->c_have_nid = 1;
+  }
+
+  addr_cache->c_wr += wr;
+  addr_cache->c_rd += rd;
+  addr_cache->c_reqs += reqs;
+}
+
+static void account(char *name, long wr, long rd, long reqs)
+{
+  struct cache_struct *addr_cache;
+  nid_t nid;
+
+  /* With --job-stats, lltop-serv gives us jobids instead of
+   * addresses, so there is nothing to resolve.  With --emit, we leave
+   * that to the lltop we report to. */
+  if (lltop_job_stats || lltop_emit) {
+    add_stats(get_name_stats(name), wr, rd, reqs);
+    return;
+  }
+
+  if (nid_parse(name, &nid) == 0) {
+    account_nid(nid, wr, rd, reqs);
+    return;
+  }
+
+  /* Not a NID we know, so go by the address alone. */
+  chop(name, '@');
+  addr_cache = lookup(&addr_dict, name, 0);
+  if (addr_cache == NULL)
+    addr_cache = add_addr(lookup(&addr_dict, name, 1));
+
+  addr_cache->c_wr += wr;
+  addr_cache->c_rd += rd;
+  addr_cache->c_reqs += reqs;
+}
+
+static int job_map_rc, job_map_errno;
+
+static void *job_map_main(void *arg)
+{
+  /* Build the job map while the servers sample.  Until this thread
+   * is joined it is the only one touching host_dict and the
+   * name_stats, since account() keeps to the address cache. */
+  job_map_rc = (*lltop_job_map)();
+  job_map_errno = errno;
+
+  return NULL;
+}
+
+static struct rcache rcache;
+
+/* Addresses are resolved in two passes over all of them, first to
+ * hosts and then to jobs.  Each pass either hands every lookup the
+ * cache misses to a batch hook at once, or runs the single lookup
+ * hook from up to lltop_resolvers threads.  The threads only touch
+ * their own addr_cache and read rcache.  Everything else (host_dict,
+ * get_name_stats(), rcache_put()) happens on the main thread. */
+
+static void set_host(struct cache_struct *addr_cache, const char *host, int is_new)
+{
+  addr_cache->c_new_host = is_new;
+  if (host != NULL && (addr_cache->c_host = strdup(host)) == NULL)
+    FATAL("out of memory\n");
+}
+
+static void set_job(struct cache_struct *addr_cache, const char *job, int is_new)
+{
+  /* Without a job, account under the host. */
+  addr_cache->c_new_job = is_new;
+  addr_cache->c_have_job = job != NULL;
+  if (job == NULL)
+    addr_cache->c_key = addr_cache->c_host;
+  else if ((addr_cache->c_key = strdup(job)) == NULL)
+    FATAL("out of memory\n");
+}
+
+static int need_job(const struct cache_struct *addr_cache)
+{
+  return addr_cache->c_host != NULL && addr_cache->c_stats < 0 &&
+    addr_cache->c_key == NULL;
+}
+
+static void resolve_host(struct cache_struct *addr_cache)
+{
   char host[MAXNAME + 1];
+  int rc;
+
+  rc = rcache_get(&rcache, RCACHE_HOST, addr_cache->c_name, host, sizeof(host));
+  if (rc >= 0)
+    set_host(addr_cache, rc ? host : NULL, 0);
+  else if ((*lltop_get_host)(addr_cache->c_name, host, sizeof(host)) == 0)
+    set_host(addr_cache, host, 1);
+  else
+    set_host(addr_cache, NULL, 1);
+}
+
+static void resolve_job(struct cache_struct *addr_cache)
+{
   char job[MAXNAME + 1];
+  int rc;
 
-  addr_cache = lookup(&addr_cache_root, addr, 1);
-  if (addr_cache->c_stats != NULL) {
-    stats = addr_cache->c_stats;
-    goto have_stats;
+  if (!need_job(addr_cache))
+    return;
+
+  rc = rcache_get(&rcache, RCACHE_JOB, addr_cache->c_host, job, sizeof(job));
+  if (rc >= 0)
+    set_job(addr_cache, rc ? job : NULL, 0);
+  else if ((*lltop_get_job)(addr_cache->c_host, job, sizeof(job)) == 0)
+    set_job(addr_cache, job, 1);
+  else
+    set_job(addr_cache, NULL, 1);
+}
+
+static void resolve_batch(struct cache_struct **addr_vec, size_t addr_count, int kind,
+                          int (*batch)(char **keys, char **vals, size_t count))
+{
+  /* Like resolve_host() or resolve_job() on every address, but send
+   * all the cache misses to batch in one go. */
+  struct cache_struct **miss_vec = alloc(addr_count * sizeof(miss_vec[0]));
+  char **keys = alloc(addr_count * sizeof(keys[0]));
+  char **vals = alloc(addr_count * sizeof(vals[0]));
+  char val[MAXNAME + 1];
+  size_t i, nr_miss = 0;
+
+  for (i = 0; i < addr_count; i++) {
+    struct cache_struct *addr_cache = addr_vec[i];
+    const char *key = kind == RCACHE_HOST ? addr_cache->c_name : addr_cache->c_host;
+    int rc;
+
+    if (kind == RCACHE_JOB && !need_job(addr_cache))
+      continue;
+
+    rc = rcache_get(&rcache, kind, key, val, sizeof(val));
+    if (rc < 0) {
+      miss_vec[nr_miss] = addr_cache;
+      keys[nr_miss++] = (char *) key;
+    } else if (kind == RCACHE_HOST) {
+      set_host(addr_cache, rc ? val : NULL, 0);
+    } else {
+      set_job(addr_cache, rc ? val : NULL, 0);
+    }
   }
 
-  if (lltop_get_host == NULL || (*lltop_get_host)(addr, host, sizeof(host)) < 0) {
-    stats = get_name_stats(addr);
-    goto have_stats;
+  TRACE("batch lookup of %zu keys\n", nr_miss);
+
+  if (nr_miss > 0 && (*batch)(keys, vals, nr_miss) < 0)
+    ERROR("batch %s lookup failed\n", kind == RCACHE_HOST ? "host" : "job");
+
+  for (i = 0; i < nr_miss; i++) {
+    if (kind == RCACHE_HOST)
+      set_host(miss_vec[i], vals[i], 1);
+    else
+      set_job(miss_vec[i], vals[i], 1);
+    free(vals[i]);
   }
 
-  host_cache = lookup(&host_cache_root, host, 0);
-  if (host_cache != NULL) {
-    stats = host_cache->c_stats;
-    goto have_stats;
+  free(vals);
+  free(keys);
+  free(miss_vec);
+}
+
+static void learn_addr(const struct cache_struct *addr_cache)
+{
+  /* Tell rcache about the lookups we made.  Failures are kept only as
+   * long as jobs, so that we try again soon. */
+  if (addr_cache->c_new_host)
+    rcache_put(&rcache, RCACHE_HOST, addr_cache->c_name, addr_cache->c_host,
+               addr_cache->c_host != NULL ? lltop_host_ttl : lltop_job_ttl);
+
+  if (addr_cache->c_new_job)
+    rcache_put(&rcache, RCACHE_JOB, addr_cache->c_host,
+               addr_cache->c_have_job ? addr_cache->c_key : NULL, lltop_job_ttl);
+}
+
+struct resolver {
+  pthread_t r_thread;
+  struct cache_struct **r_vec;
+  size_t r_count;
+  void (*r_resolve)(struct cache_struct *addr_cache);
+};
+
+static size_t next_addr;
+
+static void *resolver_main(void *arg)
+{
+  struct resolver *r = arg;
+  size_t i;
+
+  while ((i = __sync_fetch_and_add(&next_addr, 1)) < r->r_count)
+    (*r->r_resolve)(r->r_vec[i]);
+
+  return NULL;
+}
+
+static void resolve_all(struct cache_struct **addr_vec, size_t addr_count,
+                        void (*resolve)(struct cache_struct *addr_cache))
+{
+  /* Run resolve on every address with up to lltop_resolvers threads.
+   * The main thread does the work of resolver 0. */
+  int j, nr_resolvers = lltop_resolvers;
+
+  if (nr_resolvers > addr_count)
+    nr_resolvers = addr_count > 0 ? addr_count : 1;
+
+  TRACE("resolving %zu addresses with %d resolvers\n", addr_count, nr_resolvers);
+
+  struct resolver *resolvers = alloc(nr_resolvers * sizeof(resolvers[0]));
+  for (j = 0; j < nr_resolvers; j++) {
+    resolvers[j].r_vec = addr_vec;
+    resolvers[j].r_count = addr_count;
+    resolvers[j].r_resolve = resolve;
   }
 
-  if (lltop_get_job == NULL || (*lltop_get_job)(host, job, sizeof(job)) < 0) {
-    stats = get_name_stats(host);
-    goto have_stats;
+  next_addr = 0;
+  for (j = 1; j < nr_resolvers; j++) {
+    errno = pthread_create(&resolvers[j].r_thread, NULL, &resolver_main, &resolvers[j]);
+    if (errno != 0)
+      FATAL("cannot create thread: %m\n");
   }
 
-  stats = get_name_stats(job);
+  resolver_main(&resolvers[0]);
 
- have_stats:
-  addr_cache->c_stats = stats;
-  stats->ns_wr += wr;
-  stats->ns_rd += rd;
-  stats->ns_reqs += reqs;
+  for (j = 1; j < nr_resolvers; j++)
+    pthread_join(resolvers[j].r_thread, NULL);
+
+  free(resolvers);
+}
+
+static void attribute_addrs(void)
+{
+  /* Resolve all addresses, then add their counters to the right
+   * name_stats: the job that the job map gave for the address's host,
+   * or else the job for its host, or else its host, or else the
+   * address itself. */
+  size_t i;
+
+  /* rcache_open() leaves rcache empty if there is no usable file. */
+  if (lltop_cache_path != NULL)
+    rcache_open(&rcache, lltop_cache_path);
+
+  if (lltop_get_host_batch != NULL)
+    resolve_batch(addr_vec, addr_count, RCACHE_HOST, lltop_get_host_batch);
+  else if (lltop_get_host != NULL)
+    resolve_all(addr_vec, addr_count, &resolve_host);
+
+  for (i = 0; i < addr_count; i++) {
+    struct cache_struct *addr_cache = addr_vec[i], *host_cache;
+    if (addr_cache->c_host == NULL)
+      continue;
+
+    host_cache = lookup(&host_dict, addr_cache->c_host, 0);
+    if (host_cache != NULL)
+      addr_cache->c_stats = host_cache->c_stats;
+    else if (lltop_get_job == NULL && lltop_get_job_batch == NULL)
+      set_job(addr_cache, NULL, 0);
+  }
+
+  if (lltop_get_job_batch != NULL)
+    resolve_batch(addr_vec, addr_count, RCACHE_JOB, lltop_get_job_batch);
+  else if (lltop_get_job != NULL)
+    resolve_all(addr_vec, addr_count, &resolve_job);
+
+  for (i = 0; i < addr_count; i++) {
+    struct cache_struct *addr_cache = addr_vec[i];
+    long id = addr_cache->c_stats;
+
+    if (id < 0 && addr_cache->c_key != NULL) {
+      id = get_name_stats(addr_cache->c_key);
+    } else if (id < 0 && addr_cache->c_have_nid &&
+               NID_NET(addr_cache->c_nid) != MKNET(SOCKLND, 0)) {
+      /* Keep clients on other networks apart from tcp clients
+       * with the same address. */
+      char nid[MAXNAME + 1];
+      nid_format(addr_cache->c_nid, nid, sizeof(nid));
+      id = get_name_stats(nid);
+    } else if (id < 0) {
+      id = get_name_stats(addr_cache->c_name);
+    }
+
+    add_stats(id, addr_cache->c_wr, addr_cache->c_rd, addr_cache->c_reqs);
+
+    if (lltop_cache_path != NULL)
+      learn_addr(addr_cache);
+  }
+
+  if (lltop_cache_path != NULL && rcache_save(&rcache) < 0)
+    ERROR("cannot update cache `%s'\n", lltop_cache_path);
+}
+
+/* One ranking of the stats, by one of the LLTOP_RANK_* keys. */
+struct rank {
+  int r_key;
+  struct name_stats **r_vec;
+  size_t r_count;
+  struct name_stats r_other; /* Everything not in r_vec, with --limit. */
+};
+
+static long rank_value(const struct name_stats *s, int key)
+{
+  switch (key) {
+  case LLTOP_RANK_RD:
+    return s->ns_rd;
+  case LLTOP_RANK_REQS:
+    return s->ns_reqs;
+  case LLTOP_RANK_TOTAL:
+    return s->ns_wr + s->ns_rd;
+  default:
+    return s->ns_wr;
+  }
 }
 
-static int name_stats_cmp(const struct name_stats **s1, const struct name_stats **s2)
+static int name_stats_cmp(const void *p1, const void *p2, void *arg)
 {
-  /* Sort descending by writes, then reads, then requests. */
-  /* TODO Make sort rank configurable. */
-  long wr = (*s1)->ns_wr - (*s2)->ns_wr;
+  /* Sort descending by the rank's key, then by writes, then reads,
+   * then requests. */
+  const struct name_stats *s1 = *(const struct name_stats **) p1;
+  const struct name_stats *s2 = *(const struct name_stats **) p2;
+  const struct rank *r = arg;
+
+  long key = rank_value(s1, r->r_key) - rank_value(s2, r->r_key);
+  if (key != 0)
+    return key > 0 ? -1 : 1;
+
+  long wr = s1->ns_wr - s2->ns_wr;
   if (wr != 0)
     return wr > 0 ? -1 : 1;
 
-  long rd = (*s1)->ns_rd - (*s2)->ns_rd;
+  long rd = s1->ns_rd - s2->ns_rd;
   if (rd != 0)
     return rd > 0 ? -1 : 1;
 
-  long reqs = (*s1)->ns_reqs - (*s2)->ns_reqs;
+  long reqs = s1->ns_reqs - s2->ns_reqs;
   if (reqs != 0)
     return reqs > 0 ? -1 : 1;
 
+  return strcmp(s1->ns_name, s2->ns_name);
+}
+
+static void heap_sift_down(struct rank *r, size_t i)
+{
+  /* r_vec is a heap with the lowest ranked stats at the top. */
+  struct name_stats **heap = r->r_vec;
+
+  while (1) {
+    size_t low = i, left = 2 * i + 1, right = 2 * i + 2;
+
+    if (left < r->r_count && name_stats_cmp(&heap[left], &heap[low], r) > 0)
+      low = left;
+    if (right < r->r_count && name_stats_cmp(&heap[right], &heap[low], r) > 0)
+      low = right;
+    if (low == i)
+      return;
+
+    struct name_stats *tmp = heap[i];
+    heap[i] = heap[low];
+    heap[low] = tmp;
+    i = low;
+  }
+}
+
+static void rank_add(struct rank *r, struct name_stats *s, size_t limit)
+{
+  /* Keep s in r_vec if it's among the best limit so far, adding
+   * whatever doesn't make it to r_other. */
+  if (r->r_count < limit) {
+    r->r_vec[r->r_count++] = s;
+    if (r->r_count == limit) {
+      size_t i = limit / 2;
+      while (i-- > 0)
+        heap_sift_down(r, i);
+    }
+    return;
+  }
+
+  if (limit > 0 && name_stats_cmp(&s, &r->r_vec[0], r) < 0) {
+    struct name_stats *low = r->r_vec[0];
+    r->r_vec[0] = s;
+    heap_sift_down(r, 0);
+    s = low;
+  }
+
+  r->r_other.ns_wr += s->ns_wr;
+  r->r_other.ns_rd += s->ns_rd;
+  r->r_other.ns_reqs += s->ns_reqs;
+}
+
+static void rank_stats(struct rank *rank_vec, int nr_ranks, int limited)
+{
+  /* Fill in every rank in one pass over the stats.  With --limit,
+   * each rank keeps a heap of its best lltop_limit printable stats,
+   * so it takes O(count log limit) rather than sorting all of them,
+   * and adds up the rest under OTHER. */
+  size_t i, limit = limited ? (lltop_limit > 0 ? lltop_limit : 0) : name_stats_count;
+  int j;
+
+  for (j = 0; j < nr_ranks; j++) {
+    rank_vec[j].r_key = lltop_rank_vec[j];
+    rank_vec[j].r_vec = alloc(limit * sizeof(rank_vec[j].r_vec[0]));
+    rank_vec[j].r_count = 0;
+    memset(&rank_vec[j].r_other, 0, sizeof(rank_vec[j].r_other));
+    rank_vec[j].r_other.ns_name = "OTHER";
+  }
+
+  for (i = 0; i < name_stats_count; i++) {
+    struct name_stats *s = &name_stats_vec[i];
+
+    /* Stats that would never be printed are not candidates. */
+    if (limited && !lltop_show_name_stats(s->ns_wr, s->ns_rd, s->ns_reqs)) {
+      for (j = 0; j < nr_ranks; j++)
+        rank_add(&rank_vec[j], s, 0);
+      continue;
+    }
+
+    for (j = 0; j < nr_ranks; j++)
+      rank_add(&rank_vec[j], s, limit);
+  }
+
+  for (j = 0; j < nr_ranks; j++)
+    qsort_r(rank_vec[j].r_vec, rank_vec[j].r_count, sizeof(rank_vec[j].r_vec[0]),
+            &name_stats_cmp, &rank_vec[j]);
+}
+
+/* Each lltop-serv (ssh) child gets its own pipe and buffer, so its
+ * records stay intact no matter how ssh breaks up its writes, and we
+ * know where each record came from. */
+enum {
+  SERV_PENDING,  /* Not started yet, or waiting to retry. */
+  SERV_STARTING, /* Waiting for lltop-serv's ready line. */
+  SERV_READY,
+  SERV_FAILED,   /* Never got ready. */
+};
+
+struct serv_struct {
+  char *s_name;
+  const char **s_argv; /* Command line for a relay, else serv_argv. */
+  pid_t s_pid;
+  int s_fd;
+  int s_in; /* Write end of lltop-serv's stdin, for the go-ahead. */
+  int s_state, s_tries;
+  int s_binary; /* Output is binary (1), text (0), or not known yet (-1). */
+  char *s_buf;
+  size_t s_len, s_size;
+  size_t s_bytes, s_lines, s_bad;
+  struct timespec s_retry; /* Earliest time to start again. */
+  struct timespec s_start, s_ready, s_first, s_end;
+  unsigned int s_missed:1; /* Killed at the deadline, or failed. */
+};
+
+#define SERV_BUF_SIZE (16 * WIRE_FRAME_MAX)
+
+/* How many times to try ssh when it fails (exits 255) before
+ * lltop-serv is ready, as it will when sshd drops connections over
+ * its MaxStartups limit. */
+#define SERV_TRIES 3
+
+/* Extra time we give relays to get ready and to report, since they
+ * have deadlines of their own to meet first. */
+#define RELAY_SLACK 1
+
+static struct serv_struct *serv_vec;
+static int serv_vec_count;
+
+/* With --max-sessions or --start-rate, we start lltop-serv with
+ * --ready and send each one the go-ahead once they are all ready, so
+ * their intervals line up no matter when their sessions started. */
+static int serv_handshake;
+static const char *serv_argv[20];
+static int serv_argv_host; /* Index of the server name in serv_argv. */
+static struct timespec launch_start;
+
+static double timespec_diff(const struct timespec *t1, const struct timespec *t0)
+{
+  return (t1->tv_sec - t0->tv_sec) + (t1->tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+static void timespec_add(struct timespec *t, double secs)
+{
+  long nsec = t->tv_nsec + (long) ((secs - (long) secs) * 1e9);
+
+  t->tv_sec += (long) secs + nsec / 1000000000;
+  t->tv_nsec = nsec % 1000000000;
+}
+
+static void serv_line(struct serv_struct *serv, char *line, size_t len)
+{
+  char *field[4];
+  long wr, rd, reqs;
+
+  serv->s_lines++;
+
+  /* lltop-serv output is <ipv4-addr>@<net> <wr> <rd> <reqs>. */
+  if (tok_split(line, len, field, 4) != 4 ||
+      strlen(field[0]) > MAXNAME ||
+      tok_long(field[1], &wr) < 0 ||
+      tok_long(field[2], &rd) < 0 ||
+      tok_long(field[3], &reqs) < 0) {
+    /* Undo the split for the message. */
+    size_t i;
+    for (i = 0; i < len; i++)
+      if (line[i] == 0)
+        line[i] = ' ';
+    line[len] = 0;
+    ERROR("invalid line \"%s\" from `%s'\n", line, serv->s_name);
+    serv->s_bad++;
+    return;
+  }
+
+  account(field[0], wr, rd, reqs);
+}
+
+static void serv_rec(void *arg, struct wire_rec *rec)
+{
+  struct serv_struct *serv = arg;
+
+  serv->s_lines++;
+
+  /* NID records come parsed already. */
+  if (rec->r_type == WIRE_REC_NID && !lltop_job_stats && !lltop_emit)
+    account_nid(rec->r_nid, rec->r_wr, rec->r_rd, rec->r_reqs);
+  else
+    account(rec->r_name, rec->r_wr, rec->r_rd, rec->r_reqs);
+}
+
+static size_t serv_check_binary(struct serv_struct *serv)
+{
+  /* With --format=binary, see whether serv announced binary output.
+   * Returns the length of the announcement to skip, or 0 if we need
+   * more bytes or serv is sending text. */
+  size_t len = strlen(SERV_BINARY_LINE);
+
+  /* Frames without the announcement come from an lltop-serv that
+   * predates it. */
+  if (memcmp(serv->s_buf, WIRE_MAGIC, serv->s_len < 3 ? serv->s_len : 3) == 0) {
+    if (serv->s_len >= 3)
+      serv->s_binary = 1;
+    return 0;
+  }
+
+  if (memcmp(serv->s_buf, SERV_BINARY_LINE,
+             serv->s_len < len ? serv->s_len : len) != 0) {
+    ERROR("`%s' is not sending binary output, reading it as text\n", serv->s_name);
+    serv->s_binary = 0;
+    return 0;
+  }
+
+  if (serv->s_len < len)
+    return 0;
+
+  serv->s_binary = 1;
+  return len;
+}
+
+static size_t serv_parse(struct serv_struct *serv)
+{
+  /* Parse all complete lines or frames in serv's buffer, returning
+   * the number of bytes used. */
+  size_t used = 0;
+
+  if (serv->s_binary < 0) {
+    used = serv_check_binary(serv);
+    if (serv->s_binary < 0)
+      return 0;
+  }
+
+  if (serv->s_binary)
+    return used + wire_decode(serv->s_buf + used, serv->s_len - used,
+                              &serv_rec, serv, &serv->s_bad);
+
+  char *pos = serv->s_buf, *end = serv->s_buf + serv->s_len, *eol;
+  while ((eol = tok_line(pos, end)) != NULL) {
+    *eol = 0;
+    serv_line(serv, pos, eol - pos);
+    pos = eol + 1;
+  }
+
+  return pos - serv->s_buf;
+}
+
+static void serv_close(struct serv_struct *serv)
+{
+  clock_gettime(CLOCK_MONOTONIC, &serv->s_end);
+
+  /* No more bytes are coming, so a frame that is still incomplete was
+   * cut short.  Don't let it swallow any good frames after it. */
+  if (serv->s_len > 0 && serv->s_binary > 0) {
+    wire_decode_rest(serv->s_buf, serv->s_len, &serv_rec, serv, &serv->s_bad);
+    serv->s_len = 0;
+  }
+
+  if (serv->s_len > 0) {
+    ERROR("discarding %zu trailing bytes from `%s'\n", serv->s_len, serv->s_name);
+    serv->s_bad++;
+  }
+
+  if (serv->s_binary > 0 && serv->s_bad > 0)
+    ERROR("discarded %zu invalid frames from `%s'\n", serv->s_bad, serv->s_name);
+
+  close(serv->s_fd);
+  serv->s_fd = -1;
+  if (serv->s_in >= 0)
+    close(serv->s_in);
+  serv->s_in = -1;
+  free(serv->s_buf);
+  serv->s_buf = NULL;
+  waitpid(serv->s_pid, NULL, WNOHANG);
+}
+
+static void serv_eof(struct serv_struct *serv)
+{
+  /* serv is done.  If its ssh or lltop-serv failed (as an old
+   * lltop-serv does on options it doesn't know), count it as missed
+   * rather than trust whatever it sent. */
+  int status = 0;
+
+  waitpid(serv->s_pid, &status, 0);
+  serv_close(serv);
+
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    ERROR("`%s' failed with %s %d\n", serv->s_name,
+          WIFEXITED(status) ? "status" : "signal",
+          WIFEXITED(status) ? WEXITSTATUS(status) : WTERMSIG(status));
+    serv->s_missed = 1;
+  }
+}
+
+static int serv_check_ready(struct serv_struct *serv)
+{
+  /* Consume lltop-serv's ready line from the front of serv's buffer.
+   * Returns 1 once serv is ready, 0 if we need more bytes. */
+  size_t len = strlen(SERV_READY_LINE);
+
+  if (memcmp(serv->s_buf, SERV_READY_LINE,
+             serv->s_len < len ? serv->s_len : len) != 0) {
+    ERROR("no ready line from `%s', starting it anyway\n", serv->s_name);
+    len = 0;
+  } else if (serv->s_len < len) {
+    return 0;
+  }
+
+  serv->s_len -= len;
+  memmove(serv->s_buf, serv->s_buf + len, serv->s_len);
+  serv->s_state = SERV_READY;
+  clock_gettime(CLOCK_MONOTONIC, &serv->s_ready);
+  TRACE("`%s' ready after %.3f seconds\n", serv->s_name,
+        timespec_diff(&serv->s_ready, &launch_start));
+
+  return 1;
+}
+
+static int serv_read(struct serv_struct *serv)
+{
+  /* Returns 0 on EOF or error, 1 otherwise. */
+  if (serv->s_len == serv->s_size) {
+    serv->s_size *= 2;
+    serv->s_buf = realloc(serv->s_buf, serv->s_size);
+    if (serv->s_buf == NULL)
+      FATAL("out of memory\n");
+  }
+
+  ssize_t nr = read(serv->s_fd, serv->s_buf + serv->s_len, serv->s_size - serv->s_len);
+  if (nr < 0) {
+    if (errno == EINTR || errno == EAGAIN)
+      return 1;
+    ERROR("error reading from `%s': %m\n", serv->s_name);
+    return 0;
+  }
+
+  if (nr == 0)
+    return 0;
+
+  serv->s_len += nr;
+
+  if (serv->s_state == SERV_STARTING) {
+    if (!serv_check_ready(serv))
+      return 1;
+    nr = serv->s_len; /* Whatever followed the ready line. */
+    if (nr == 0)
+      return 1;
+  }
+
+  if (serv->s_bytes == 0) {
+    TRACE("got first bytes from `%s'\n", serv->s_name);
+    clock_gettime(CLOCK_MONOTONIC, &serv->s_first);
+  }
+
+  serv->s_bytes += nr;
+
+  size_t used = serv_parse(serv);
+  serv->s_len -= used;
+  memmove(serv->s_buf, serv->s_buf + used, serv->s_len);
+
+  return 1;
+}
+
+static int poll_timeout(const struct timespec *deadline)
+{
+  /* Milliseconds until deadline, or -1 if there is none. */
+  struct timespec now;
+
+  if (deadline == NULL)
+    return -1;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double ms = 1000 * timespec_diff(deadline, &now);
+
+  return ms > 0 ? (int) ms + 1 : 0;
+}
+
+static void kill_servs(int max_state)
+{
+  /* Called at the deadline, give up on everyone still running whose
+   * state is at most max_state (SERV_STARTING while launching). */
+  int i;
+
+  for (i = 0; i < serv_vec_count; i++) {
+    struct serv_struct *serv = &serv_vec[i];
+    if (serv->s_state > max_state)
+      continue;
+
+    if (serv->s_state == SERV_PENDING) {
+      serv->s_state = SERV_FAILED;
+      serv->s_missed = 1;
+      continue;
+    }
+
+    if (serv->s_fd < 0)
+      continue;
+
+    TRACE("killing `%s', pid %d\n", serv->s_name, (int) serv->s_pid);
+    if (kill(serv->s_pid, SIGTERM) < 0 && errno != ESRCH)
+      ERROR("cannot kill `%s', pid %d: %m\n", serv->s_name, (int) serv->s_pid);
+
+    if (serv->s_state == SERV_STARTING)
+      serv->s_state = SERV_FAILED;
+    serv->s_missed = 1;
+    serv->s_len = 0; /* Don't complain about the partial record. */
+    serv_close(serv);
+  }
+}
+
+static void serv_launch(struct serv_struct *serv)
+{
+  int out[2], in[2] = { -1, -1 };
+
+  /* Both pipes are close on exec so that the other children don't
+   * hold them open. */
+  if (pipe2(out, O_CLOEXEC) < 0 || (serv_handshake && pipe2(in, O_CLOEXEC) < 0))
+    FATAL("cannot create pipe for lltop-serv subprocesses: %m\n");
+
+  serv->s_tries++;
+  serv->s_size = SERV_BUF_SIZE;
+  serv->s_buf = alloc(serv->s_size);
+  serv->s_len = 0;
+  serv->s_binary = lltop_binary ? -1 : 0;
+  clock_gettime(CLOCK_MONOTONIC, &serv->s_start);
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    FATAL("cannot fork: %m\n");
+  } else if (pid == 0) {
+    /* Redirect stdout to the write end of the pipe, and stdin from
+     * the go-ahead pipe if we have one. */
+    dup2(out[1], 1);
+    if (in[0] >= 0)
+      dup2(in[0], 0);
+    serv_argv[serv_argv_host] = serv->s_name;
+    execv(lltop_ssh_path, (char **) (serv->s_argv != NULL ? serv->s_argv : serv_argv));
+    FATAL("cannot exec '%s': %m\n", lltop_ssh_path);
+  }
+
+  close(out[1]);
+  if (in[0] >= 0)
+    close(in[0]);
+
+  serv->s_pid = pid;
+  serv->s_fd = out[0];
+  serv->s_in = in[1];
+  serv->s_state = serv_handshake ? SERV_STARTING : SERV_READY;
+  if (!serv_handshake)
+    serv->s_ready = serv->s_start;
+}
+
+static void serv_launch_failed(struct serv_struct *serv, double *rate)
+{
+  /* serv's ssh exited before lltop-serv was ready.  If ssh itself
+   * failed, back off and try again later, and slow down. */
+  struct timespec now;
+  int status = 0;
+
+  waitpid(serv->s_pid, &status, 0);
+  serv_close(serv);
+
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 255 || serv->s_tries >= SERV_TRIES) {
+    ERROR("`%s' exited before lltop-serv was ready, giving up\n", serv->s_name);
+    serv->s_state = SERV_FAILED;
+    return;
+  }
+
+  TRACE("ssh to `%s' failed, retrying\n", serv->s_name);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  serv->s_retry = now;
+  timespec_add(&serv->s_retry, 1 << (serv->s_tries - 1));
+  serv->s_state = SERV_PENDING;
+
+  if (*rate / 2 >= lltop_start_rate)
+    *rate /= 2;
+}
+
+static void launch_servs(const struct timespec *deadline)
+{
+  /* Start an ssh session for each server, with no more than
+   * lltop_max_sessions connecting at once.  With lltop_start_rate,
+   * also space out the starts, beginning at lltop_start_rate per
+   * second and doubling the rate every second that passes without a
+   * failed session. */
+  struct pollfd *pfd = alloc(serv_vec_count * sizeof(pfd[0]));
+  struct timespec now, next_start, rate_stamp;
+  double rate = lltop_start_rate;
+  int i, nr_pending = serv_vec_count, nr_starting = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  next_start = rate_stamp = now;
+
+  while (nr_pending + nr_starting > 0) {
+    const struct timespec *wake = deadline;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (i = 0; i < serv_vec_count && nr_pending > 0; i++) {
+      struct serv_struct *serv = &serv_vec[i];
+      if (serv->s_state != SERV_PENDING)
+        continue;
+
+      if (lltop_max_sessions > 0 && nr_starting >= lltop_max_sessions)
+        break;
+
+      if (timespec_diff(&serv->s_retry, &now) > 0) {
+        if (wake == NULL || timespec_diff(&serv->s_retry, wake) < 0)
+          wake = &serv->s_retry;
+        continue;
+      }
+
+      if (lltop_start_rate > 0 && timespec_diff(&next_start, &now) > 0) {
+        if (wake == NULL || timespec_diff(&next_start, wake) < 0)
+          wake = &next_start;
+        break;
+      }
+
+      serv_launch(serv);
+      nr_pending--;
+      if (serv->s_state == SERV_STARTING)
+        nr_starting++;
+
+      if (lltop_start_rate > 0) {
+        if (timespec_diff(&now, &rate_stamp) >= 1) {
+          rate *= 2;
+          rate_stamp = now;
+        }
+        next_start = now;
+        timespec_add(&next_start, 1 / rate);
+      }
+    }
+
+    if (nr_pending + nr_starting == 0)
+      break;
+
+    int nr_pfd = 0;
+    for (i = 0; i < serv_vec_count; i++) {
+      if (serv_vec[i].s_state != SERV_STARTING)
+        continue;
+      pfd[nr_pfd].fd = serv_vec[i].s_fd;
+      pfd[nr_pfd].events = POLLIN;
+      pfd[nr_pfd].revents = 0;
+      nr_pfd++;
+    }
+
+    int nr_ready = poll(pfd, nr_pfd, poll_timeout(wake));
+    if (nr_ready < 0) {
+      if (errno == EINTR)
+        continue;
+      FATAL("cannot poll lltop-serv pipes: %m\n");
+    }
+
+    if (nr_ready == 0 && poll_timeout(deadline) == 0) {
+      kill_servs(SERV_STARTING);
+      break;
+    }
+
+    int j;
+    for (i = 0, j = 0; i < serv_vec_count && j < nr_pfd; i++) {
+      struct serv_struct *serv = &serv_vec[i];
+      if (serv->s_state != SERV_STARTING)
+        continue;
+
+      if (pfd[j++].revents == 0)
+        continue;
+
+      if (!serv_read(serv)) {
+        nr_starting--;
+        serv_launch_failed(serv, &rate);
+        if (serv->s_state == SERV_PENDING)
+          nr_pending++;
+      } else if (serv->s_state == SERV_READY) {
+        nr_starting--;
+      }
+    }
+  }
+
+  free(pfd);
+}
+
+static void send_go(void)
+{
+  /* Tell every ready lltop-serv to take its first sample. */
+  int i;
+
+  for (i = 0; i < serv_vec_count; i++) {
+    struct serv_struct *serv = &serv_vec[i];
+    if (serv->s_in < 0)
+      continue;
+
+    if (serv->s_state == SERV_READY &&
+        write(serv->s_in, SERV_GO_LINE, strlen(SERV_GO_LINE)) < 0)
+      ERROR("cannot start `%s': %m\n", serv->s_name);
+
+    close(serv->s_in);
+    serv->s_in = -1;
+  }
+}
+
+static void read_servs(const struct timespec *deadline)
+{
+  struct pollfd *pfd = alloc(serv_vec_count * sizeof(pfd[0]));
+  int i, nr_open = 0;
+
+  for (i = 0; i < serv_vec_count; i++)
+    if (serv_vec[i].s_fd >= 0)
+      nr_open++;
+
+  while (nr_open > 0) {
+    int nr_pfd = 0;
+    for (i = 0; i < serv_vec_count; i++) {
+      if (serv_vec[i].s_fd < 0)
+        continue;
+      pfd[nr_pfd].fd = serv_vec[i].s_fd;
+      pfd[nr_pfd].events = POLLIN;
+      pfd[nr_pfd].revents = 0;
+      nr_pfd++;
+    }
+
+    int nr_ready = poll(pfd, nr_pfd, poll_timeout(deadline));
+    if (nr_ready < 0) {
+      if (errno == EINTR)
+        continue;
+      FATAL("cannot poll lltop-serv pipes: %m\n");
+    }
+
+    if (nr_ready == 0 && poll_timeout(deadline) == 0) {
+      kill_servs(SERV_READY);
+      break;
+    }
+
+    int j;
+    for (i = 0, j = 0; i < serv_vec_count && j < nr_pfd; i++) {
+      struct serv_struct *serv = &serv_vec[i];
+      if (serv->s_fd < 0)
+        continue;
+
+      if (pfd[j++].revents != 0 && !serv_read(serv)) {
+        serv_eof(serv);
+        nr_open--;
+      }
+    }
+  }
+
+  free(pfd);
+}
+
+static void print_serv_stats(FILE *file)
+{
+  int i;
+
+  /* START_S is when each server was ready, relative to the first
+   * launch.  FIRST_S and LAST_S are relative to the last launch of
+   * that server's ssh. */
+  fprintf(file, "%-16s %5s %8s %10s %8s %8s %8s %8s\n",
+          "SERVER", "TRIES", "START_S", "BYTES", "RECORDS", "INVALID", "FIRST_S", "LAST_S");
+
+  for (i = 0; i < serv_vec_count; i++) {
+    struct serv_struct *serv = &serv_vec[i];
+    fprintf(file, "%-16s %5d %8.3f %10zu %8zu %8zu %8.3f %8.3f\n",
+            serv->s_name, serv->s_tries,
+            serv->s_state == SERV_READY ? timespec_diff(&serv->s_ready, &launch_start) : 0.0,
+            serv->s_bytes, serv->s_lines, serv->s_bad,
+            serv->s_bytes > 0 ? timespec_diff(&serv->s_first, &serv->s_start) : 0.0,
+            timespec_diff(&serv->s_end, &serv->s_start));
+  }
+}
+
+static const char **relay_argv(const char *relay, char **serv_list, int serv_count)
+{
+  /* Command line to run lltop --emit on relay for serv_list. */
+  const char **argv = alloc((serv_argv_host + 20 + serv_count) * sizeof(argv[0]));
+  int i, argc = 0;
+
+  for (i = 0; i < serv_argv_host; i++)
+    argv[argc++] = serv_argv[i];
+
+  argv[argc++] = relay;
+  argv[argc++] = lltop_relay_path;
+  argv[argc++] = "--emit";
+  argv[argc++] = serv_argv[serv_argv_host + 2]; /* --interval=N */
+  if (lltop_job_stats)
+    argv[argc++] = "--job-stats";
+  if (lltop_binary)
+    argv[argc++] = "--format=binary";
+  if (serv_handshake)
+    argv[argc++] = "--ready";
+
+  /* Relays launch their servers the same way we would. */
+  char *arg;
+#define RELAY_ARG(fmt,val) do {                  \
+    if (asprintf(&arg, fmt, val) < 0)           \
+      FATAL("out of memory\n");                 \
+    argv[argc++] = arg;                         \
+  } while (0)
+  RELAY_ARG("--lltop-serv=%s", lltop_serv_path);
+  RELAY_ARG("--remote-shell=%s", lltop_ssh_path);
+  if (lltop_max_sessions > 0)
+    RELAY_ARG("--max-sessions=%d", lltop_max_sessions);
+  if (lltop_start_rate > 0)
+    RELAY_ARG("--start-rate=%d", lltop_start_rate);
+  if (lltop_persist > 0)
+    RELAY_ARG("--persist=%d", lltop_persist);
+  if (lltop_deadline > 0)
+    RELAY_ARG("--deadline=%d", lltop_deadline);
+  if (lltop_serv_socket != NULL)
+    RELAY_ARG("--serv-socket=%s", lltop_serv_socket);
+  if (lltop_serv_baseline != NULL)
+    RELAY_ARG("--serv-baseline=%s", lltop_serv_baseline);
+  if (lltop_serv_share != NULL)
+    RELAY_ARG("--serv-share=%s", lltop_serv_share);
+#undef RELAY_ARG
+
+  argv[argc++] = "-l";
+  for (i = 0; i < serv_count; i++)
+    if ((argv[argc++] = strdup(serv_list[i])) == NULL)
+      FATAL("out of memory\n");
+  argv[argc++] = NULL;
+
+  return argv;
+}
+
+static int wait_go(int fd)
+{
+  /* As a relay with --ready, tell our lltop we're ready and wait for
+   * its go-ahead on fd, like lltop-serv --ready does. */
+  char line[80];
+  size_t len = 0;
+
+  if (write(1, SERV_READY_LINE, strlen(SERV_READY_LINE)) < 0)
+    return -1;
+
+  while (len < sizeof(line) - 1) {
+    ssize_t nr = read(fd, line + len, 1);
+    if (nr < 0 && errno == EINTR)
+      continue;
+    if (nr <= 0)
+      return -1;
+    if (line[len++] == '\n')
+      break;
+  }
+  line[len] = 0;
+  close(fd);
+
+  return strcmp(line, SERV_GO_LINE) == 0 ? 0 : -1;
+}
+
+static void emit_stats(void)
+{
+  /* As a relay, write our per-client totals in lltop-serv format. */
+  struct wire_buf wire_buf;
+  size_t i;
+
+  wire_buf_init(&wire_buf, 1);
+
+  if (lltop_binary && (fputs(SERV_BINARY_LINE, stdout) < 0 || fflush(stdout) != 0))
+    FATAL("cannot write output: %m\n");
+
+  for (i = 0; i < name_stats_count; i++) {
+    struct name_stats *s = &name_stats_vec[i];
+
+    if (!lltop_binary)
+      printf("%s %ld %ld %ld\n", s->ns_name, s->ns_wr, s->ns_rd, s->ns_reqs);
+    else if (wire_buf_put(&wire_buf, s->ns_name, !lltop_job_stats,
+                          s->ns_wr, s->ns_rd, s->ns_reqs) < 0)
+      FATAL("cannot write output: %m\n");
+  }
+
+  if (lltop_binary && wire_buf_flush(&wire_buf) < 0)
+    FATAL("cannot write output: %m\n");
+}
+
+static int private_dir(char *dir, size_t size)
+{
+  /* Put in dir a directory that only we can get into, for our ssh
+   * control sockets and such: lltop under $XDG_RUNTIME_DIR, or
+   * /tmp/lltop-<uid>. */
+  const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+  struct stat st;
+  int len;
+
+  if (runtime_dir != NULL && *runtime_dir != 0)
+    len = snprintf(dir, size, "%s/lltop", runtime_dir);
+  else
+    len = snprintf(dir, size, "/tmp/lltop-%d", (int) getuid());
+
+  if (len < 0 || len >= size)
+    return -1;
+
+  if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+    ERROR("cannot create `%s': %m\n", dir);
+    return -1;
+  }
+
+  if (lstat(dir, &st) < 0) {
+    ERROR("cannot stat `%s': %m\n", dir);
+    return -1;
+  }
+
+  if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077) != 0) {
+    ERROR("`%s' is not a private directory owned by us\n", dir);
+    return -1;
+  }
+
   return 0;
 }
 
+static int share_start(struct tcache *tc, int argc, char *argv[],
+                       char **serv_list, int serv_count)
+{
+  /* With --share, the table is keyed on our options (less the
+   * --share ones) and servers.  Returns 1 if we printed a shared
+   * table, 0 if we should make ours and share it, or -1 if we should
+   * make ours and keep it to ourselves. */
+  char *key = NULL, *table = NULL, dir[PATH_MAX];
+  const char *share_dir = lltop_share_dir;
+  size_t key_len = 0, len = 0;
+  int i, rc;
+
+  /* By default, root shares through DEFAULT_LLTOP_SHARE_DIR, and
+   * everyone else only with their own runs. */
+  if (share_dir == NULL && getuid() == 0) {
+    share_dir = DEFAULT_LLTOP_SHARE_DIR;
+  } else if (share_dir == NULL) {
+    if (private_dir(dir, sizeof(dir)) < 0 ||
+        strlen(dir) + strlen("/share") >= sizeof(dir)) {
+      ERROR("cannot find a directory to share tables through\n");
+      return -1;
+    }
+    strcat(dir, "/share");
+    share_dir = dir;
+  }
+
+  FILE *file = open_memstream(&key, &key_len);
+  if (file == NULL)
+    FATAL("out of memory\n");
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--share-age") == 0)
+      i++;
+    else if (strncmp(argv[i], "--share", strlen("--share")) != 0)
+      fprintf(file, "%s%c", argv[i], 0);
+  }
+
+  fputc(0, file);
+  for (i = 0; i < serv_count; i++)
+    fprintf(file, "%s%c", serv_list[i], 0);
+
+  if (fclose(file) != 0)
+    FATAL("out of memory\n");
+
+  rc = tcache_open(tc, share_dir, key, key_len,
+                   lltop_share_age >= 0 ? lltop_share_age : lltop_intvl);
+  free(key);
+  if (rc < 0)
+    return -1;
+
+  rc = tcache_get(tc, &table, &len);
+  if (rc > 0) {
+    TRACE("printing shared table\n");
+    fwrite(table, 1, len, stdout);
+    free(table);
+  }
+
+  if (rc != 0)
+    tcache_close(tc);
+
+  return rc;
+}
+
 int main(int argc, char *argv[])
 {
   char **serv_list = NULL;
@@ -182,104 +1414,246 @@ int main(int argc, char *argv[])
   if (lltop_config(argc, argv, &serv_list, &serv_count) < 0)
     FATAL("lltop_config() failed\n");
 
+  if (nid_table_init(&addr_table, 0) < 0 || dict_init(&addr_dict, 0) < 0 ||
+      dict_init(&host_dict, 0) < 0 || dict_init(&name_dict, 0) < 0)
+    FATAL("out of memory\n");
+
+  /* With --share, print another lltop's table if it is fresh or
+   * being made now, rather than asking the servers again.  Relays
+   * answer to an lltop that does its own sharing. */
+  struct tcache tcache;
+  int share_rc = -1;
+  if (lltop_share && !lltop_emit && !lltop_ready) {
+    share_rc = share_start(&tcache, argc, argv, serv_list, serv_count);
+    if (share_rc > 0)
+      return 0;
+  }
+
   char intvl_arg[80];
   snprintf(intvl_arg, sizeof(intvl_arg), "--interval=%d", lltop_intvl);
 
+  char socket_arg[PATH_MAX + 80], baseline_arg[PATH_MAX + 80], share_arg[PATH_MAX + 80];
+  if (lltop_serv_socket != NULL)
+    snprintf(socket_arg, sizeof(socket_arg), "--socket=%s", lltop_serv_socket);
+  if (lltop_serv_baseline != NULL)
+    snprintf(baseline_arg, sizeof(baseline_arg), "--baseline=%s", lltop_serv_baseline);
+  if (lltop_serv_share != NULL)
+    snprintf(share_arg, sizeof(share_arg), "--share=%s", lltop_serv_share);
+
+  serv_handshake = lltop_max_sessions > 0 || lltop_start_rate > 0 || lltop_ready;
+
+  /* Command line for ssh, server name goes in serv_argv[serv_argv_host]. */
+  char persist_dir[PATH_MAX], persist_path[PATH_MAX + 80], persist_arg[80];
+  int serv_argc = 0;
+  serv_argv[serv_argc++] = lltop_ssh_path;
+  if (lltop_persist > 0) {
+    if (private_dir(persist_dir, sizeof(persist_dir)) < 0)
+      FATAL("cannot create directory for ssh control sockets\n");
+    snprintf(persist_path, sizeof(persist_path), "ControlPath=%s/%%C", persist_dir);
+    snprintf(persist_arg, sizeof(persist_arg), "ControlPersist=%d", lltop_persist);
+    serv_argv[serv_argc++] = "-o";
+    serv_argv[serv_argc++] = "ControlMaster=auto";
+    serv_argv[serv_argc++] = "-o";
+    serv_argv[serv_argc++] = persist_path;
+    serv_argv[serv_argc++] = "-o";
+    serv_argv[serv_argc++] = persist_arg;
+  }
+  serv_argv_host = serv_argc;
+  serv_argv[serv_argc++] = NULL;
+  serv_argv[serv_argc++] = lltop_serv_path;
+  serv_argv[serv_argc++] = intvl_arg;
+  if (lltop_job_stats)
+    serv_argv[serv_argc++] = "--job-stats";
+  if (lltop_binary)
+    serv_argv[serv_argc++] = "--format=binary";
+  if (serv_handshake)
+    serv_argv[serv_argc++] = "--ready";
+  if (lltop_serv_socket != NULL)
+    serv_argv[serv_argc++] = socket_arg;
+  if (lltop_serv_baseline != NULL)
+    serv_argv[serv_argc++] = baseline_arg;
+  if (lltop_serv_share != NULL)
+    serv_argv[serv_argc++] = share_arg;
+  serv_argv[serv_argc++] = NULL;
+
+  /* With --ready, our go-ahead comes on stdin. */
+  int go_fd = lltop_ready ? fcntl(0, F_DUPFD_CLOEXEC, 3) : -1;
+  if (lltop_ready && go_fd < 0)
+    FATAL("cannot dup stdin: %m\n");
+
   close(0);
   open("/dev/null", O_RDONLY);
 
-  int fdv[2];
-  if (pipe(fdv) < 0)
-    FATAL("cannot create pipe for lltop-serv subprocesses: %m\n");
+  /* A server may die before we send its go-ahead. */
+  signal(SIGPIPE, SIG_IGN);
 
   TRACE("starting lltop-serv subprocesses\n");
 
-  int i;
-  for (i = 0; i < serv_count; i++) {
-    pid_t pid = fork();
-    if (pid < 0) {
-      FATAL("cannot fork: %m\n");
-    } else if (pid == 0) {
-      /* Close read end of pipe, redirect stdout to write end. */
-      close(fdv[0]);
-      dup2(fdv[1], 1);
-      close(fdv[1]);
-      execl(lltop_ssh_path, lltop_ssh_path, serv_list[i],
-            lltop_serv_path, intvl_arg, (char*) NULL);
-      FATAL("cannot exec '%s': %m\n", lltop_ssh_path);
+  /* With --relay, our "servers" are the relays, each running lltop
+   * --emit for its share of the server list. */
+  int i, slack = 0;
+  if (lltop_relay_count > 0) {
+    if (lltop_relay_count > serv_count)
+      lltop_relay_count = serv_count;
+
+    serv_vec = alloc(lltop_relay_count * sizeof(serv_vec[0]));
+    serv_vec_count = lltop_relay_count;
+    slack = RELAY_SLACK;
+  } else {
+    serv_vec = alloc(serv_count * sizeof(serv_vec[0]));
+    serv_vec_count = serv_count;
+  }
+
+  for (i = 0; i < serv_vec_count; i++) {
+    struct serv_struct *serv = &serv_vec[i];
+
+    memset(serv, 0, sizeof(*serv));
+    if (lltop_relay_count > 0) {
+      int first = i * serv_count / serv_vec_count;
+      int last = (i + 1) * serv_count / serv_vec_count;
+      serv->s_name = strdup(lltop_relay_list[i]);
+      serv->s_argv = relay_argv(lltop_relay_list[i], serv_list + first, last - first);
+    } else {
+      serv->s_name = strdup(serv_list[i]);
     }
+    if (serv->s_name == NULL)
+      FATAL("out of memory\n");
+    serv->s_fd = -1;
+    serv->s_in = -1;
+    serv->s_state = SERV_PENDING;
   }
   lltop_free_serv_list(serv_list, serv_count);
-  close(fdv[1]);
 
-  if (lltop_job_map != NULL && (*lltop_job_map)() < 0)
-    FATAL("cannot get job map: %m\n");
+  /* With --deadline, give servers deadline seconds to get ready. */
+  clock_gettime(CLOCK_MONOTONIC, &launch_start);
+  struct timespec deadline = launch_start;
+  deadline.tv_sec += lltop_deadline + slack;
 
-  TRACE("reading lltop-serv output\n");
+  launch_servs(lltop_deadline > 0 ? &deadline : NULL);
 
-  FILE *stats_pipe = fdopen(fdv[0], "r");
-  if (stats_pipe == NULL)
-    FATAL("cannot create pipe: %m\n");
+  if (lltop_ready && wait_go(go_fd) < 0) {
+    TRACE("no go-ahead, exiting\n");
+    return 0;
+  }
 
-  char *line = NULL;
-  size_t line_size = 0;
-  int line_count = 0;
+  /* The interval starts now for everyone who got ready. */
+  struct timespec run_start;
+  clock_gettime(CLOCK_MONOTONIC, &run_start);
+  send_go();
 
-  while (getline(&line, &line_size, stats_pipe) >= 0) {
-    if (line_count++ == 0)
-      TRACE("got first line from lltop-serv\n");
+  /* Get the job map during the interval, rather than before reading
+   * and leaving lltop-serv output to back up in the pipes. */
+  pthread_t job_map_thread;
+  if (lltop_job_map != NULL) {
+    errno = pthread_create(&job_map_thread, NULL, &job_map_main, NULL);
+    if (errno != 0)
+      FATAL("cannot create thread: %m\n");
+  }
 
-#if MAXNAME != 1024
-#error MAXNAME != 1024 may break sscanf().
-#endif
-    char addr[MAXNAME + 1];
-    long wr, rd, reqs;
-    /* lltop-serv output is <ipv4-addr>@<net> <wr> <rd> <reqs>. */
-    if (sscanf(line, "%1024s %ld %ld %ld", addr, &wr, &rd, &reqs) != 4) {
-      ERROR("invalid line \"%s\"\n", chop(line, '\n'));
-      continue;
-    }
+  TRACE("reading lltop-serv output\n");
 
-    /* Chop off '@<net>' and account. */
-    account(chop(addr, '@'), wr, rd, reqs);
+  /* With --deadline, stop waiting for servers deadline seconds after
+   * they should have finished, and report what we have. */
+  deadline = run_start;
+  deadline.tv_sec += lltop_intvl + lltop_deadline + slack;
+
+  read_servs(lltop_deadline > 0 ? &deadline : NULL);
+
+  if (lltop_job_map != NULL) {
+    pthread_join(job_map_thread, NULL);
+    errno = job_map_errno;
+    if (job_map_rc < 0)
+      FATAL("cannot get job map: %m\n");
   }
-  free(line);
 
-  TRACE("read %d lines from lltop-serv\n", line_count);
+  if (lltop_serv_stats)
+    print_serv_stats(stderr);
 
-  if (ferror(stats_pipe))
-    ERROR("error reading from pipe: %m\n");
+  /* As a relay, report our missed servers on stderr (which ssh passes
+   * along) and leave the table to the lltop we report to. */
+  FILE *missed_file = stdout;
+  struct rank *rank_vec = NULL;
+
+  /* When sharing, make the table in memory, then save and print it. */
+  FILE *table_file = stdout;
+  char *table = NULL;
+  size_t table_len = 0;
+  if (share_rc == 0) {
+    table_file = missed_file = open_memstream(&table, &table_len);
+    if (table_file == NULL)
+      FATAL("out of memory\n");
+  }
 
-  if (fclose(stats_pipe) < 0)
-    ERROR("error closing pipe: %m\n");
+  attribute_addrs();
+  lltop_fini();
+
+  if (lltop_emit) {
+    emit_stats();
+    missed_file = stderr;
+    goto print_missed;
+  }
 
   TRACE("sorting and printing stats\n");
 
-  /* OK, done reading, now sort and print. */
-  struct name_stats **stats_vec;
-  stats_vec = alloc(name_stats_count * sizeof(struct name_stats*));
+  /* OK, done reading, now rank and print.  With --limit, only the
+   * top jobs get sorted, and the rest are added up under OTHER.  A
+   * limit of 0 or less prints no jobs at all, not even OTHER. */
+  int j, limited = lltop_limit <= 0 || (size_t) lltop_limit < name_stats_count;
+  rank_vec = alloc(lltop_rank_count * sizeof(rank_vec[0]));
+  rank_stats(rank_vec, lltop_rank_count, limited);
 
-  i = 0;
-  struct rb_node *node;
-  for (node = rb_first(&name_stats_root); node != NULL; node = rb_next(node))
-    stats_vec[i++] = rb_entry(node, struct name_stats, ns_node);
+  for (j = 0; j < lltop_rank_count; j++) {
+    struct rank *r = &rank_vec[j];
 
-  qsort(stats_vec, name_stats_count, sizeof(struct name_stats*),
-        (int (*)(const void*, const void*)) &name_stats_cmp);
+    if (lltop_rank_count > 1)
+      lltop_print_rank(table_file, j, lltop_rank_names[r->r_key]);
 
-  lltop_print_header(stdout);
+    lltop_print_header(table_file);
 
-  for (i = 0; i < name_stats_count; i++) {
-    struct name_stats *s = stats_vec[i];
-    lltop_print_name_stats(stdout, s->ns_name, s->ns_wr, s->ns_rd, s->ns_reqs);
+    for (i = 0; i < r->r_count; i++) {
+      struct name_stats *s = r->r_vec[i];
+      lltop_print_name_stats(table_file, s->ns_name, s->ns_wr, s->ns_rd, s->ns_reqs);
+    }
+
+    if (limited && lltop_limit > 0)
+      lltop_print_name_stats(table_file, r->r_other.ns_name, r->r_other.ns_wr,
+                             r->r_other.ns_rd, r->r_other.ns_reqs);
+  }
+
+ print_missed:;
+  int nr_missed = 0;
+  const char **missed = alloc(serv_vec_count * sizeof(missed[0]));
+  for (i = 0; i < serv_vec_count; i++)
+    if (serv_vec[i].s_missed)
+      missed[nr_missed++] = serv_vec[i].s_name;
+
+  if (nr_missed > 0)
+    lltop_print_missed(missed_file, missed, nr_missed, serv_vec_count);
+  free(missed);
+
+  if (share_rc == 0) {
+    if (fclose(table_file) != 0)
+      FATAL("out of memory\n");
+    tcache_put(&tcache, table, table_len);
+    tcache_close(&tcache);
+    fwrite(table, 1, table_len, stdout);
+    free(table);
   }
 
   /* Cleanup is somewhat pointless since we're exiting right away. */
 #ifdef DEBUG
-  rb_destroy(&addr_cache_root, offsetof(struct cache_struct, c_node), &free);
-  rb_destroy(&host_cache_root, offsetof(struct cache_struct, c_node), &free);
-  rb_destroy(&name_stats_root, offsetof(struct name_stats, ns_node), &free);
-  free(stats_vec);
+  for (i = 0; i < addr_count; i++)
+    free(addr_vec[i]);
+  free(addr_vec);
+  nid_table_destroy(&addr_table);
+  dict_destroy(&addr_dict, NULL);
+  dict_destroy(&host_dict, &free_cache_key);
+  dict_destroy(&name_dict, &free_name_id_key);
+  free(name_stats_vec);
+  if (rank_vec != NULL)
+    for (i = 0; i < lltop_rank_count; i++)
+      free(rank_vec[i].r_vec);
+  free(rank_vec);
 #endif
 
   return 0;
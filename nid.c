@@ -0,0 +1,248 @@
+/* lltop nid.c
+ * Copyright 2010 by John L. Hammond <jhammond@tacc.utexas.edu>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "nid.h"
+
+/* LND types and names from lnet/include/lnet/nidstr.h.  Networks
+   with nt_ip set use dotted quad addresses, the others use plain
+   integers (0@lo, 1234@gni). */
+static const struct net_type {
+  const char *nt_name;
+  int nt_type;
+  int nt_ip;
+} net_types[] = {
+  { "elan",    1, 0 },
+  { "tcp",     2, 1 },
+  { "gm",      3, 0 },
+  { "ptl",     4, 0 },
+  { "o2ib",    5, 1 },
+  { "cib",     6, 1 },
+  { "openib",  7, 1 },
+  { "iib",     8, 1 },
+  { "lo",      9, 0 },
+  { "ra",     10, 1 },
+  { "vib",    11, 1 },
+  { "mx",     12, 1 },
+  { "gni",    13, 0 },
+  { "gip",    14, 1 },
+  { "ptlf",   15, 0 },
+  { "kfi",    16, 0 },
+};
+
+#define NR_NET_TYPES (sizeof(net_types) / sizeof(net_types[0]))
+
+static const struct net_type *net_type_by_type(int type)
+{
+  size_t i;
+  for (i = 0; i < NR_NET_TYPES; i++)
+    if (net_types[i].nt_type == type)
+      return &net_types[i];
+
+  return NULL;
+}
+
+static int parse_uint(const char *s, unsigned long max, unsigned long *val)
+{
+  char *end;
+
+  if (*s < '0' || '9' < *s)
+    return -1;
+
+  *val = strtoul(s, &end, 10);
+  if (*end != 0 || *val > max)
+    return -1;
+
+  return 0;
+}
+
+static int parse_net(const char *s, uint32_t *net, const struct net_type **nt_out)
+{
+  /* The net is a type name followed by an optional number, and some
+     names are prefixes of others (ptl, ptlf), so take the longest
+     name that leaves only digits. */
+  const struct net_type *nt = NULL;
+  size_t i, len = 0;
+  unsigned long num = 0;
+
+  for (i = 0; i < NR_NET_TYPES; i++) {
+    size_t l = strlen(net_types[i].nt_name);
+    if (l <= len || strncmp(s, net_types[i].nt_name, l) != 0)
+      continue;
+
+    if (s[l] != 0 && parse_uint(s + l, 0xffff, &num) < 0)
+      continue;
+
+    nt = &net_types[i];
+    len = l;
+  }
+
+  if (nt == NULL)
+    return -1;
+
+  num = 0;
+  if (s[len] != 0)
+    parse_uint(s + len, 0xffff, &num);
+
+  *net = MKNET(nt->nt_type, num);
+  *nt_out = nt;
+  return 0;
+}
+
+int nid_parse(const char *str, nid_t *nid)
+{
+  char addr_str[64];
+  const char *at = strchr(str, '@');
+  const struct net_type *nt = net_type_by_type(SOCKLND);
+  uint32_t net = MKNET(SOCKLND, 0);
+  size_t addr_len = at != NULL ? at - str : strlen(str);
+
+  if (addr_len == 0 || addr_len >= sizeof(addr_str))
+    return -1;
+
+  memcpy(addr_str, str, addr_len);
+  addr_str[addr_len] = 0;
+
+  if (at != NULL && parse_net(at + 1, &net, &nt) < 0)
+    return -1;
+
+  if (nt->nt_ip) {
+    struct in_addr in;
+    if (inet_pton(AF_INET, addr_str, &in) < 1)
+      return -1;
+    *nid = MKNID(net, ntohl(in.s_addr));
+  } else {
+    unsigned long addr;
+    if (parse_uint(addr_str, 0xffffffffUL, &addr) < 0)
+      return -1;
+    *nid = MKNID(net, addr);
+  }
+
+  return 0;
+}
+
+int nid_format_addr(nid_t nid, char *buf, size_t size)
+{
+  const struct net_type *nt = net_type_by_type(NET_TYPE(NID_NET(nid)));
+  uint32_t addr = NID_ADDR(nid);
+
+  if (nt == NULL || nt->nt_ip)
+    return snprintf(buf, size, "%u.%u.%u.%u", addr >> 24,
+                    (addr >> 16) & 0xff, (addr >> 8) & 0xff, addr & 0xff);
+  else
+    return snprintf(buf, size, "%u", addr);
+}
+
+int nid_format(nid_t nid, char *buf, size_t size)
+{
+  uint32_t net = NID_NET(nid);
+  const struct net_type *nt = net_type_by_type(NET_TYPE(net));
+  int len = nid_format_addr(nid, buf, size);
+
+  if (len < 0 || len >= size)
+    return len;
+
+  if (nt == NULL)
+    return len + snprintf(buf + len, size - len, "@<%u:%u>", NET_TYPE(net), NET_NUM(net));
+  else if (NET_NUM(net) == 0)
+    return len + snprintf(buf + len, size - len, "@%s", nt->nt_name);
+  else
+    return len + snprintf(buf + len, size - len, "@%s%u", nt->nt_name, NET_NUM(net));
+}
+
+#define NID_TABLE_LEN_MIN 64
+
+static size_t nid_hash(nid_t nid, size_t mask)
+{
+  /* Fibonacci hashing, so that consecutive addresses spread out. */
+  return (size_t) ((nid * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
+}
+
+int nid_table_init(struct nid_table *nt, size_t count)
+{
+  size_t len = NID_TABLE_LEN_MIN;
+
+  /* Keep the load under 1/2. */
+  while (2 * count >= len)
+    len *= 2;
+
+  nt->nt_table = calloc(len, sizeof(nt->nt_table[0]));
+  if (nt->nt_table == NULL)
+    return -1;
+
+  nt->nt_len = len;
+  nt->nt_count = 0;
+  return 0;
+}
+
+void nid_table_destroy(struct nid_table *nt)
+{
+  free(nt->nt_table);
+  memset(nt, 0, sizeof(*nt));
+}
+
+static struct nid_entry *nid_table_probe(struct nid_entry *table, size_t len, nid_t nid)
+{
+  size_t mask = len - 1, i = nid_hash(nid, mask);
+
+  while (table[i].ne_ptr != NULL && table[i].ne_nid != nid)
+    i = (i + 1) & mask;
+
+  return &table[i];
+}
+
+static int nid_table_grow(struct nid_table *nt)
+{
+  size_t i, len = 2 * nt->nt_len;
+  struct nid_entry *table = calloc(len, sizeof(table[0]));
+
+  if (table == NULL)
+    return -1;
+
+  for (i = 0; i < nt->nt_len; i++)
+    if (nt->nt_table[i].ne_ptr != NULL)
+      *nid_table_probe(table, len, nt->nt_table[i].ne_nid) = nt->nt_table[i];
+
+  free(nt->nt_table);
+  nt->nt_table = table;
+  nt->nt_len = len;
+  return 0;
+}
+
+struct nid_entry *nid_table_ref(struct nid_table *nt, nid_t nid)
+{
+  struct nid_entry *ne = nid_table_probe(nt->nt_table, nt->nt_len, nid);
+
+  if (ne->ne_ptr != NULL)
+    return ne;
+
+  /* A new entry.  The caller must set ne_ptr, so count it now. */
+  if (2 * (nt->nt_count + 1) >= nt->nt_len) {
+    if (nid_table_grow(nt) < 0)
+      return NULL;
+    ne = nid_table_probe(nt->nt_table, nt->nt_len, nid);
+  }
+
+  nt->nt_count++;
+  ne->ne_nid = nid;
+  return ne;
+}
@@ -0,0 +1,55 @@
+#ifndef _NID_H_
+#define _NID_H_
+#include <stddef.h>
+#include <stdint.h>
+
+/* Packed LNet NIDs, laid out like lnet_nid_t: the network (LND type
+   in the high 16 bits, network number in the low 16) in the upper 32
+   bits and the address in the lower 32 bits.  So 192.0.32.10@o2ib3 is
+   MKNID(MKNET(O2IBLND, 3), 0xc000200a). */
+typedef uint64_t nid_t;
+
+#define NID_NET(nid) ((uint32_t) ((nid) >> 32))
+#define NID_ADDR(nid) ((uint32_t) (nid))
+#define MKNID(net,addr) ((((nid_t) (net)) << 32) | (uint32_t) (addr))
+
+#define NET_TYPE(net) (((net) >> 16) & 0xffff)
+#define NET_NUM(net) ((net) & 0xffff)
+#define MKNET(type,num) ((((uint32_t) (type)) << 16) | ((num) & 0xffff))
+
+/* The LND type of tcp, the network of NIDs with no "@<net>". */
+#define SOCKLND 2
+
+/* Parse "<addr>@<net>" (or just "<addr>", meaning @tcp) into *nid.
+   Returns 0 on success, -1 if str is not a NID we understand. */
+int nid_parse(const char *str, nid_t *nid);
+
+/* Format nid as "<addr>@<net>" into buf. */
+int nid_format(nid_t nid, char *buf, size_t size);
+
+/* Format just the address part of nid, which is what lltop_get_host()
+   expects. */
+int nid_format_addr(nid_t nid, char *buf, size_t size);
+
+/* Open addressing hash table of pointers keyed by NID. */
+struct nid_entry {
+  nid_t ne_nid;
+  void *ne_ptr; /* NULL if the entry is free. */
+};
+
+struct nid_table {
+  struct nid_entry *nt_table;
+  size_t nt_len; /* A power of two. */
+  size_t nt_count;
+};
+
+/* The count argument is only a hint. */
+int nid_table_init(struct nid_table *nt, size_t count);
+void nid_table_destroy(struct nid_table *nt);
+
+/* Return the entry for nid, adding it (with ne_ptr NULL, for the
+   caller to set) if it's not there.  The entry is valid until the
+   next call. */
+struct nid_entry *nid_table_ref(struct nid_table *nt, nid_t nid);
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef _PLUGIN_H_
+#define _PLUGIN_H_
+#include <stddef.h>
+
+/* Resolver plugins for lltop.  A plugin is a shared object, loaded
+   with --plugin=PATH[:ARG], that defines
+
+     struct lltop_plugin lltop_plugin = { .p_abi = LLTOP_PLUGIN_ABI, ... };
+
+   lltop calls p_init(ARG) once (ARG is NULL if not given), then uses
+   every lookup the plugin provides in place of the built in one, and
+   calls p_fini() once all lookups are done.  Any entry point may be
+   NULL.  The built in lookups in hooks.c are plugins too.
+
+   p_get_host and p_get_job look up one address or host, like the
+   lltop_get_host and lltop_get_job hooks, and may be called from
+   several threads at once.  If p_get_host_batch or p_get_job_batch
+   is given, lltop uses it instead, from one thread, with all the
+   lookups at once: set vals[i] to the malloc()ed host or job for
+   keys[i], or to NULL if there is none.  p_job_map should call
+   set_job(host, job) for every host with a job.  All return 0 on
+   success and -1 on failure. */
+
+#define LLTOP_PLUGIN_ABI 1
+#define LLTOP_PLUGIN_SYMBOL "lltop_plugin"
+
+struct lltop_plugin {
+  int p_abi; /* LLTOP_PLUGIN_ABI */
+  const char *p_name;
+  int (*p_init)(const char *arg);
+  void (*p_fini)(void);
+  int (*p_get_host)(const char *addr, char *host, size_t host_size);
+  int (*p_get_job)(const char *host, char *job, size_t job_size);
+  int (*p_get_host_batch)(char **addrs, char **hosts, size_t count);
+  int (*p_get_job_batch)(char **hosts, char **jobs, size_t count);
+  int (*p_job_map)(void (*set_job)(const char *host, const char *job));
+};
+
+#endif
@@ -0,0 +1,280 @@
+/* lltop rcache.c
+ * Copyright 2010 by John L. Hammond <jhammond@tacc.utexas.edu>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "lltop.h"
+#include "rcache.h"
+
+static int entry_cmp(const struct rcache_entry *e1, const struct rcache_entry *e2)
+{
+  if (e1->e_kind != e2->e_kind)
+    return e1->e_kind < e2->e_kind ? -1 : 1;
+
+  return strncmp(e1->e_key, e2->e_key, sizeof(e1->e_key));
+}
+
+static void rcache_unmap(struct rcache *cache)
+{
+  if (cache->rc_map != NULL)
+    munmap(cache->rc_map, cache->rc_map_size);
+  cache->rc_map = NULL;
+  cache->rc_map_size = 0;
+  cache->rc_vec = NULL;
+  cache->rc_count = 0;
+}
+
+static int rcache_map(struct rcache *cache)
+{
+  const struct rcache_header *hdr;
+  struct stat st;
+  int fd, rc = -1;
+
+  fd = open(cache->rc_path, O_RDONLY|O_CLOEXEC);
+  if (fd < 0) {
+    if (errno == ENOENT)
+      return 0;
+    ERROR("cannot open `%s': %m\n", cache->rc_path);
+    return -1;
+  }
+
+  if (fstat(fd, &st) < 0) {
+    ERROR("cannot stat `%s': %m\n", cache->rc_path);
+    goto out;
+  }
+
+  if (st.st_size < sizeof(*hdr))
+    goto bad;
+
+  cache->rc_map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (cache->rc_map == MAP_FAILED) {
+    cache->rc_map = NULL;
+    ERROR("cannot map `%s': %m\n", cache->rc_path);
+    goto out;
+  }
+  cache->rc_map_size = st.st_size;
+
+  hdr = cache->rc_map;
+  if (memcmp(hdr->h_magic, RCACHE_MAGIC, sizeof(hdr->h_magic)) != 0 ||
+      hdr->h_version != RCACHE_VERSION ||
+      hdr->h_entry_size != sizeof(struct rcache_entry) ||
+      st.st_size != sizeof(*hdr) + (off_t) hdr->h_count * sizeof(struct rcache_entry))
+    goto bad;
+
+  cache->rc_vec = (const struct rcache_entry *) (hdr + 1);
+  cache->rc_count = hdr->h_count;
+  rc = 0;
+  goto out;
+
+ bad:
+  ERROR("ignoring invalid cache file `%s'\n", cache->rc_path);
+  rcache_unmap(cache);
+ out:
+  close(fd);
+  return rc;
+}
+
+int rcache_open(struct rcache *cache, const char *path)
+{
+  memset(cache, 0, sizeof(*cache));
+  cache->rc_path = path;
+
+  return rcache_map(cache);
+}
+
+void rcache_close(struct rcache *cache)
+{
+  rcache_unmap(cache);
+  free(cache->rc_new);
+  cache->rc_new = NULL;
+  cache->rc_new_count = cache->rc_new_size = 0;
+}
+
+int rcache_get(const struct rcache *cache, int kind, const char *key,
+               char *val, size_t val_size)
+{
+  struct rcache_entry k;
+  const struct rcache_entry *e;
+
+  if (cache->rc_vec == NULL || strlen(key) > RCACHE_NAME_MAX)
+    return -1;
+
+  k.e_kind = kind;
+  strcpy(k.e_key, key);
+
+  e = bsearch(&k, cache->rc_vec, cache->rc_count, sizeof(*e),
+              (int (*)(const void *, const void *)) &entry_cmp);
+  if (e == NULL || e->e_expires <= time(NULL))
+    return -1;
+
+  if (e->e_neg)
+    return 0;
+
+  snprintf(val, val_size, "%.*s", (int) sizeof(e->e_val), e->e_val);
+  return 1;
+}
+
+void rcache_put(struct rcache *cache, int kind, const char *key,
+                const char *val, time_t ttl)
+{
+  struct rcache_entry *e;
+
+  if (strlen(key) > RCACHE_NAME_MAX || (val != NULL && strlen(val) > RCACHE_NAME_MAX))
+    return;
+
+  if (cache->rc_new_count == cache->rc_new_size) {
+    cache->rc_new_size = cache->rc_new_size > 0 ? 2 * cache->rc_new_size : 256;
+    cache->rc_new = realloc(cache->rc_new, cache->rc_new_size * sizeof(cache->rc_new[0]));
+    if (cache->rc_new == NULL)
+      FATAL("out of memory\n");
+  }
+
+  e = &cache->rc_new[cache->rc_new_count++];
+  memset(e, 0, sizeof(*e));
+  e->e_kind = kind;
+  e->e_neg = val == NULL;
+  e->e_expires = time(NULL) + ttl;
+  strcpy(e->e_key, key);
+  if (val != NULL)
+    strcpy(e->e_val, val);
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+  const char *p = buf;
+
+  while (len > 0) {
+    ssize_t nr = write(fd, p, len);
+    if (nr < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += nr;
+    len -= nr;
+  }
+
+  return 0;
+}
+
+int rcache_save(struct rcache *cache)
+{
+  struct rcache_header hdr;
+  struct rcache_entry *vec = NULL;
+  size_t i, j, count = 0;
+  char *tmp_path = NULL;
+  time_t now = time(NULL);
+  int fd = -1, rc = -1;
+
+  if (cache->rc_new_count == 0)
+    return 0;
+
+  /* Someone may have replaced the file since we opened it, so merge
+   * with whatever is there now. */
+  rcache_unmap(cache);
+  rcache_map(cache);
+
+  qsort(cache->rc_new, cache->rc_new_count, sizeof(cache->rc_new[0]),
+        (int (*)(const void *, const void *)) &entry_cmp);
+
+  vec = alloc((cache->rc_new_count + cache->rc_count) * sizeof(vec[0]));
+
+  /* Merge the sorted lists, new entries win, drop expired ones. */
+  for (i = 0, j = 0; i < cache->rc_new_count || j < cache->rc_count; ) {
+    const struct rcache_entry *e;
+    int cmp;
+
+    if (i == cache->rc_new_count)
+      cmp = 1;
+    else if (j == cache->rc_count)
+      cmp = -1;
+    else
+      cmp = entry_cmp(&cache->rc_new[i], &cache->rc_vec[j]);
+
+    if (cmp <= 0) {
+      e = &cache->rc_new[i++];
+      if (cmp == 0)
+        j++;
+    } else {
+      e = &cache->rc_vec[j++];
+    }
+
+    if (e->e_expires <= now)
+      continue;
+
+    if (count > 0 && entry_cmp(&vec[count - 1], e) == 0)
+      continue;
+
+    vec[count++] = *e;
+  }
+
+  if (asprintf(&tmp_path, "%s.%d.tmp", cache->rc_path, (int) getpid()) < 0) {
+    tmp_path = NULL;
+    goto out;
+  }
+
+  fd = open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+  if (fd < 0) {
+    ERROR("cannot create `%s': %m\n", tmp_path);
+    goto out;
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.h_magic, RCACHE_MAGIC, sizeof(hdr.h_magic));
+  hdr.h_version = RCACHE_VERSION;
+  hdr.h_entry_size = sizeof(struct rcache_entry);
+  hdr.h_count = count;
+
+  if (write_all(fd, &hdr, sizeof(hdr)) < 0 ||
+      write_all(fd, vec, count * sizeof(vec[0])) < 0) {
+    ERROR("cannot write `%s': %m\n", tmp_path);
+    goto out;
+  }
+
+  if (close(fd) < 0) {
+    fd = -1;
+    ERROR("cannot write `%s': %m\n", tmp_path);
+    goto out;
+  }
+  fd = -1;
+
+  if (rename(tmp_path, cache->rc_path) < 0) {
+    ERROR("cannot rename `%s' to `%s': %m\n", tmp_path, cache->rc_path);
+    goto out;
+  }
+
+  cache->rc_new_count = 0;
+  rc = 0;
+
+ out:
+  if (fd >= 0)
+    close(fd);
+  if (rc < 0 && tmp_path != NULL)
+    unlink(tmp_path);
+  free(tmp_path);
+  free(vec);
+
+  return rc;
+}
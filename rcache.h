@@ -0,0 +1,68 @@
+#ifndef _RCACHE_H_
+#define _RCACHE_H_
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Resolution cache file (lltop --cache).  The file is a header and a
+   sorted array of fixed size entries, which we mmap and bsearch.
+   Writers build a new file and rename() it into place, so readers
+   always see a complete cache, and the mapping of an old file stays
+   valid after it is replaced.  Concurrent writers may lose each
+   other's new entries, which only costs some lookups next time. */
+
+#define RCACHE_MAGIC "LLTC"
+#define RCACHE_VERSION 1
+
+#define RCACHE_HOST 1 /* Address to host. */
+#define RCACHE_JOB 2 /* Host to job. */
+
+#define RCACHE_NAME_MAX 127
+
+struct rcache_header {
+  char h_magic[4];
+  uint32_t h_version;
+  uint32_t h_entry_size;
+  uint32_t h_count;
+};
+
+struct rcache_entry {
+  uint8_t e_kind;
+  uint8_t e_neg; /* The lookup failed. */
+  uint8_t e_pad[6];
+  int64_t e_expires; /* Wall clock seconds. */
+  char e_key[RCACHE_NAME_MAX + 1];
+  char e_val[RCACHE_NAME_MAX + 1];
+};
+
+struct rcache {
+  const char *rc_path;
+  void *rc_map;
+  size_t rc_map_size;
+  const struct rcache_entry *rc_vec;
+  size_t rc_count;
+  struct rcache_entry *rc_new; /* Added by rcache_put(). */
+  size_t rc_new_count, rc_new_size;
+};
+
+/* Map the cache at path, if it exists and is valid. */
+int rcache_open(struct rcache *cache, const char *path);
+void rcache_close(struct rcache *cache);
+
+/* Look up key of kind.  Returns 1 and copies the value into val on a
+   hit, 0 on a hit for a failed lookup, -1 on a miss.  Only looks at
+   the mapped file, so it is safe to call from several threads. */
+int rcache_get(const struct rcache *cache, int kind, const char *key,
+               char *val, size_t val_size);
+
+/* Remember that key of kind resolved to val (NULL if the lookup
+   failed) for ttl seconds.  Names too long for the cache are
+   dropped. */
+void rcache_put(struct rcache *cache, int kind, const char *key,
+                const char *val, time_t ttl);
+
+/* Merge the new entries with the unexpired entries of the current
+   file and replace it. */
+int rcache_save(struct rcache *cache);
+
+#endif
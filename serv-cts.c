@@ -19,6 +19,7 @@
 /* TODO Error messages should include hostname. */
 #define _GNU_SOURCE
 #include <dirent.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -29,18 +30,25 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
 #include <sys/un.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include "string1.h"
 #include "lltop.h"
 #include "dict.h"
+#include "stats.h"
 
 #define LLTOP_MSG_MAX 64000 /* UDP max minus stuff minus some other stuff. */
 #define LLTOP_PORT "9907"
 #define NR_CLIENTS_HINT 4096 /* Initial dict size. */
 
 struct dict name_stats_dict;
+struct stats_buf stats_buf;
 
 #define NS_WR 0 /* MOVEME. */
 #define NS_RD 1
@@ -99,12 +107,23 @@ int msg_buf_flush(struct msg_buf *mb)
   return 0;
 }
 
+/* Per client counters.  ns_cur adds up the client's totals over all
+   targets during a generation.  At the end of the generation the
+   change since ns_last goes into slot gen % nr_slots of ns_ring, so
+   the load over any window of up to nr_slots generations is a sum of
+   slots. */
 struct name_stats {
-  long ns_stats[2][3];
+  int64_t ns_cur[3], ns_last[3];
+  int64_t (*ns_ring)[3];
   unsigned int ns_gen;
   char ns_name[];
 };
 
+#define MAX_WINDOWS 8
+int window_vec[MAX_WINDOWS]; /* Seconds, from --windows. */
+int nr_windows = 0;
+unsigned int nr_slots = 1;
+
 static inline struct name_stats *key_ns(char *key)
 {
   /* As an exercise to the reader, figure out why offsetof() doesn't
@@ -114,14 +133,52 @@ static inline struct name_stats *key_ns(char *key)
   return (struct name_stats *) (key - ns_name_offset);
 }
 
+/* Each target keeps its exports directory and the stats file of
+   every export open between generations, so that a generation is
+   normally just one fstat() of the directory plus one pread() per
+   export.  The directory is rescanned only when its mtime or link
+   count changes, when a cached fd goes bad, or every rescan_gens
+   generations. */
 struct lustre_target {
   char *name;
   char *export_dir_path;
+  char *job_stats_path;
+  int job_stats_fd;
+  int export_dir_fd;
+  struct timespec export_dir_mtime;
+  nlink_t export_dir_nlink;
+  struct dict export_dict;
+  unsigned int scan_gen;
+  unsigned int need_scan:1;
+};
+
+struct export {
+  int e_fd; /* -1 if we ran out of fds, then open on each read. */
+  unsigned int e_gen; /* Generation of the last scan that found us. */
+  unsigned int e_open_gen;
+  ino_t e_ino; /* To notice a client that reconnected between scans. */
+  char e_name[];
 };
 
+static inline struct export *key_export(char *key)
+{
+  return (struct export *) (key - offsetof(struct export, e_name));
+}
+
 size_t nr_targets = 0;
 struct lustre_target *target_list = NULL;
 
+#define RESCAN_GENS 6 /* Rescan exports dirs at least this often. */
+unsigned int rescan_gens = RESCAN_GENS;
+
+/* Per generation counters, see write_counters(). */
+struct {
+  size_t c_opens;
+  size_t c_opens_avoided;
+  size_t c_scans;
+  size_t c_exports;
+} counters;
+
 int de_is_subdir(const struct dirent *de)
 {
   return de->d_type == DT_DIR && de->d_name[0] != '.';
@@ -148,10 +205,19 @@ int get_target_list(struct lustre_target **list, size_t *nr, const char *dir_pat
   *list = new_list;
 
   for (i = *nr, j = 0; i < new_nr; i++, j++) {
+    memset(&(*list)[i], 0, sizeof((*list)[i]));
     (*list)[i].name = strdup(de[j]->d_name);
     /* XXX */
     (*list)[i].export_dir_path = strf("%s/%s/exports", dir_path, de[j]->d_name);
     /* XXX */
+    (*list)[i].export_dir_fd = -1;
+    (*list)[i].job_stats_path = strf("%s/%s/job_stats", dir_path, de[j]->d_name);
+    (*list)[i].job_stats_fd = -1;
+    (*list)[i].need_scan = 1;
+    if (dict_init(&(*list)[i].export_dict, NR_CLIENTS_HINT) < 0) {
+      ERROR("cannot create export dictionary: %m\n");
+      goto out;
+    }
   }
 
   *nr = new_nr;
@@ -165,54 +231,14 @@ int get_target_list(struct lustre_target **list, size_t *nr, const char *dir_pat
   return rc;
 }
 
-int read_client_stats(const char *cli_name, unsigned int gen)
+int account_client_stats(const char *cli_name, unsigned int gen,
+                         long wr, long rd, long reqs)
 {
-  char stats_path[80];
-  FILE *stats_file = NULL;
-  char stats_file_buf[BUFSIZ];
-  char *line = NULL;
-  size_t line_size = 0;
-  long wr = 0, rd = 0, reqs = 0;
-
-  TRACE("cli_name %s, gen %d\n", cli_name, gen);
-
-  snprintf(stats_path, sizeof(stats_path), "%s/stats", cli_name);
-
-  stats_file = fopen(stats_path, "r");
-  if (stats_file == NULL) {
-    ERROR("cannot open %s: %m\n", stats_path);
-    goto out;
-  }
-  setvbuf(stats_file, stats_file_buf, _IOFBF, sizeof(stats_file_buf));
-
-  /* Skip the helpful snapshot_time. */
-  getline(&line, &line_size, stats_file);
-
-  while (getline(&line, &line_size, stats_file) >= 0) {
-    char ctr_name[80];
-    long ctr_samples, ctr_sum = 0;
-
-    /* XXX Do we need to check ctr_units? */
-    if (sscanf(line, "%79s %ld samples [%*[^]]] %*d %*d %ld",
-               ctr_name, &ctr_samples, &ctr_sum) < 2) {
-      ERROR("invalid line \"%s\"\n", chop(line, '\n'));
-      continue;
-    }
-
-    if (strcmp(ctr_name, "write_bytes") == 0) {
-      wr = ctr_sum;
-    } else if (strcmp(ctr_name, "read_bytes") == 0) {
-      rd = ctr_sum;
-    } else if (strcmp(ctr_name, "ping") != 0) { /* Ignore pings. */
-      reqs += ctr_samples;
-    }
-  }
-
   /* Look up cli_name. */
   struct name_stats *ns = NULL;
   hash_t hash = dict_strhash(cli_name);
   struct dict_entry *de = dict_entry_ref(&name_stats_dict, hash, cli_name);
-  long *s = NULL;
+  int64_t *s = NULL;
 
   if (de->d_key != NULL) {
     ns = key_ns(de->d_key);
@@ -221,6 +247,9 @@ int read_client_stats(const char *cli_name, unsigned int gen)
 
   ns = alloc(sizeof(*ns) + strlen(cli_name) + 1);
   memset(ns, 0, sizeof(*ns));
+  ns->ns_ring = calloc(nr_slots, sizeof(ns->ns_ring[0]));
+  if (ns->ns_ring == NULL)
+    FATAL("out of memory\n");
   ns->ns_gen = gen;
   strcpy(ns->ns_name, cli_name);
 
@@ -228,9 +257,9 @@ int read_client_stats(const char *cli_name, unsigned int gen)
     FATAL("dict_entry_set: %m\n");
 
  have_ns:
-  s = ns->ns_stats[gen % 2];
+  s = ns->ns_cur;
   if (ns->ns_gen != gen) {
-    memset(s, 0, 3 * sizeof(long));
+    memset(s, 0, sizeof(ns->ns_cur));
     ns->ns_gen = gen;
   }
 
@@ -238,68 +267,557 @@ int read_client_stats(const char *cli_name, unsigned int gen)
   s[NS_RD] += rd;
   s[NS_REQS] += reqs;
 
- out:
-  free(line);
-  if (stats_file != NULL)
-    fclose(stats_file);
+  return 0;
+}
+
+static int export_open(struct lustre_target *target, const char *cli_name)
+{
+  char stats_path[80];
+  snprintf(stats_path, sizeof(stats_path), "%s/stats", cli_name);
+
+  counters.c_opens++;
+  return openat(target->export_dir_fd, stats_path, O_RDONLY);
+}
+
+static ino_t export_ino(struct lustre_target *target, const char *cli_name)
+{
+  char stats_path[80];
+  struct stat st;
+
+  snprintf(stats_path, sizeof(stats_path), "%s/stats", cli_name);
+  if (fstatat(target->export_dir_fd, stats_path, &st, 0) < 0)
+    return 0;
+
+  return st.st_ino;
+}
+
+static void export_remove(struct lustre_target *target, struct dict_entry *de)
+{
+  struct export *e = key_export(de->d_key);
+
+  TRACE("target %s, removing export `%s'\n", target->name, e->e_name);
+  if (e->e_fd >= 0)
+    close(e->e_fd);
+  dict_entry_remv(&target->export_dict, de, 0);
+  free(e);
+}
+
+static int scan_exports(struct lustre_target *target, unsigned int gen)
+{
+  int fd;
+  DIR *exp_dir = NULL;
+
+  TRACE("target %s, gen %d, scanning exports\n", target->name, gen);
+  counters.c_scans++;
+
+  fd = dup(target->export_dir_fd);
+  if (fd < 0 || (exp_dir = fdopendir(fd)) == NULL) {
+    ERROR("cannot open `%s': %m\n", target->export_dir_path);
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+
+  /* The dup shares its offset with export_dir_fd, so start over. */
+  rewinddir(exp_dir);
+
+  struct dirent *ent;
+  while ((ent = readdir(exp_dir)) != NULL) {
+    if (!de_is_subdir(ent))
+      continue;
+
+    hash_t hash = dict_strhash(ent->d_name);
+    struct dict_entry *de = dict_entry_ref(&target->export_dict, hash, ent->d_name);
+    struct export *e;
+
+    if (de->d_key != NULL) {
+      e = key_export(de->d_key);
+      if (e->e_fd < 0 || export_ino(target, e->e_name) == e->e_ino) {
+        e->e_gen = gen;
+        continue;
+      }
+      /* Same client, new export.  Start over. */
+      export_remove(target, de);
+      de = dict_entry_ref(&target->export_dict, hash, ent->d_name);
+    }
+
+    e = alloc(sizeof(*e) + strlen(ent->d_name) + 1);
+    strcpy(e->e_name, ent->d_name);
+    e->e_gen = gen;
+    e->e_open_gen = gen;
+    e->e_fd = export_open(target, e->e_name);
+    if (e->e_fd < 0 && errno != EMFILE && errno != ENFILE) {
+      ERROR("cannot open `%s/%s/stats': %m\n", target->export_dir_path, e->e_name);
+      free(e);
+      continue;
+    }
+
+    struct stat st;
+    e->e_ino = e->e_fd >= 0 && fstat(e->e_fd, &st) == 0 ? st.st_ino : 0;
+
+    if (dict_entry_set(&target->export_dict, de, hash, e->e_name) < 0)
+      FATAL("dict_entry_set: %m\n");
+  }
+  closedir(exp_dir);
+
+  /* Forget exports that went away. */
+  size_t i = 0;
+  struct dict_entry *de;
+  while ((de = dict_for_each_ref(&target->export_dict, &i)) != NULL)
+    if (key_export(de->d_key)->e_gen != gen)
+      export_remove(target, de);
+
+  target->scan_gen = gen;
+  target->need_scan = 0;
+
+  return 0;
+}
+
+static void job_stats_cb(void *arg, const char *job, long wr, long rd, long reqs)
+{
+  unsigned int *gen = arg;
+
+  account_client_stats(job, *gen, wr, rd, reqs);
+}
+
+int read_target_job_stats(struct lustre_target *target, unsigned int gen)
+{
+  /* With --job-stats there is just one file per target, which we
+     keep open like the export stats files. */
+  TRACE("target %s, gen %d\n", target->name, gen);
+
+  if (target->job_stats_fd < 0) {
+    counters.c_opens++;
+    target->job_stats_fd = open(target->job_stats_path, O_RDONLY);
+    if (target->job_stats_fd < 0) {
+      ERROR("cannot open `%s': %m\n", target->job_stats_path);
+      return 0;
+    }
+  } else {
+    counters.c_opens_avoided++;
+  }
+
+  ssize_t len = stats_buf_pread(&stats_buf, target->job_stats_fd);
+  if (len < 0) {
+    ERROR("cannot read `%s': %m\n", target->job_stats_path);
+    close(target->job_stats_fd);
+    target->job_stats_fd = -1;
+    return 0;
+  }
+
+  stats_parse_jobs(stats_buf.sb_buf, len, &job_stats_cb, &gen);
 
   return 0;
 }
 
 int read_target_stats(struct lustre_target *target, unsigned int gen)
 {
-  DIR *exp_dir = NULL;
+  struct stat st;
+
   TRACE("target %s, gen %d\n", target->name, gen);
 
-  if (chdir(target->export_dir_path) < 0) {
-    ERROR("cannot chdir to `%s': %m\n", target->export_dir_path);
-    /* TODO Invalidate target or something. */
+  if (target->export_dir_fd < 0) {
+    target->export_dir_fd = open(target->export_dir_path, O_RDONLY|O_DIRECTORY);
+    if (target->export_dir_fd < 0) {
+      ERROR("cannot open `%s': %m\n", target->export_dir_path);
+      /* TODO Invalidate target or something. */
+      return 0;
+    }
+  }
+
+  if (fstat(target->export_dir_fd, &st) < 0) {
+    ERROR("cannot stat `%s': %m\n", target->export_dir_path);
+    close(target->export_dir_fd);
+    target->export_dir_fd = -1;
+    target->need_scan = 1;
+    return 0;
+  }
+
+  if (st.st_mtim.tv_sec != target->export_dir_mtime.tv_sec ||
+      st.st_mtim.tv_nsec != target->export_dir_mtime.tv_nsec ||
+      st.st_nlink != target->export_dir_nlink ||
+      gen - target->scan_gen >= rescan_gens)
+    target->need_scan = 1;
+
+  target->export_dir_mtime = st.st_mtim;
+  target->export_dir_nlink = st.st_nlink;
+
+  if (target->need_scan)
+    scan_exports(target, gen);
+
+  size_t i = 0;
+  struct dict_entry *de;
+  while ((de = dict_for_each_ref(&target->export_dict, &i)) != NULL) {
+    struct export *e = key_export(de->d_key);
+    long wr = 0, rd = 0, reqs = 0;
+    ssize_t len;
+
+    counters.c_exports++;
+
+    if (e->e_fd >= 0) {
+      if (e->e_open_gen != gen)
+        counters.c_opens_avoided++;
+      len = stats_buf_pread(&stats_buf, e->e_fd);
+    } else {
+      /* Out of fds when we found it, so open and close it each time. */
+      int fd = export_open(target, e->e_name);
+      len = fd < 0 ? -1 : stats_buf_pread(&stats_buf, fd);
+      if (fd >= 0)
+        close(fd);
+    }
+
+    if (len <= 0) {
+      /* Most likely the client was evicted. */
+      TRACE("cannot read `%s/%s/stats': %m\n", target->export_dir_path, e->e_name);
+      export_remove(target, de);
+      target->need_scan = 1;
+      continue;
+    }
+
+    stats_parse(stats_buf.sb_buf, len, &wr, &rd, &reqs);
+    account_client_stats(e->e_name, gen, wr, rd, reqs);
+  }
+
+  return 0;
+}
+
+int write_counters(const char *path, unsigned int gen)
+{
+  /* Replace path with this generation's counters, for monitoring. */
+  int rc = -1;
+  char *tmp_path = strf("%s.tmp", path);
+  FILE *file = NULL;
+
+  if (tmp_path == NULL)
+    goto out;
+
+  file = fopen(tmp_path, "w");
+  if (file == NULL)
     goto out;
+
+  fprintf(file, "gen %u\nexports %zu\nopens %zu\nopens_avoided %zu\nscans %zu\n",
+          gen, counters.c_exports, counters.c_opens, counters.c_opens_avoided,
+          counters.c_scans);
+
+  if (fclose(file) < 0)
+    goto out;
+
+  rc = rename(tmp_path, path);
+
+ out:
+  if (rc < 0)
+    ERROR("cannot write counters to `%s': %m\n", path);
+  free(tmp_path);
+
+  return rc;
+}
+
+static void end_gen(unsigned int gen)
+{
+  /* Forget clients we didn't see in generation gen, and put the
+     change in everyone else's totals into their slot for gen.  There
+     is no change to speak of in generation 0. */
+  size_t i = 0;
+  struct dict_entry *de;
+  while ((de = dict_for_each_ref(&name_stats_dict, &i)) != NULL) {
+    struct name_stats *ns = key_ns(de->d_key);
+    int64_t *slot = ns->ns_ring[gen % nr_slots];
+    int j;
+
+    if (ns->ns_gen != gen) {
+      TRACE("stale stats found for client `%s', removing\n", ns->ns_name);
+      dict_entry_remv(&name_stats_dict, de, 0);
+      free(ns->ns_ring);
+      free(ns);
+      continue;
+    }
+
+    for (j = 0; j < 3; j++) {
+      slot[j] = gen == 0 ? 0 : ns->ns_cur[j] - ns->ns_last[j];
+      ns->ns_last[j] = ns->ns_cur[j];
+    }
   }
+}
 
-  exp_dir = opendir(".");
-  if (exp_dir == NULL) {
-    ERROR("cannot open `%s': %m\n", target->export_dir_path);
+static void window_sum(struct name_stats *ns, unsigned int gen, unsigned int nr,
+                       long *wr, long *rd, long *reqs)
+{
+  /* Add up the slots for the nr generations ending with gen. */
+  int64_t sum[3] = { 0, 0, 0 };
+  unsigned int k;
+
+  for (k = 0; k < nr && k <= gen; k++) {
+    int64_t *slot = ns->ns_ring[(gen - k) % nr_slots];
+    sum[NS_WR] += slot[NS_WR];
+    sum[NS_RD] += slot[NS_RD];
+    sum[NS_REQS] += slot[NS_REQS];
+  }
+
+  *wr = sum[NS_WR];
+  *rd = sum[NS_RD];
+  *reqs = sum[NS_REQS];
+}
+
+/* With --socket=PATH we answer queries on the Unix socket PATH between
+   generations.  A query is one line giving a window in seconds, which
+   must be a multiple of the interval and no longer than the longest
+   of --windows.  The answer is "ok SECONDS", where SECONDS is how much
+   of the window we have seen, then the usual lines for the load over
+   that window.  Anything else gets a line saying what went wrong.
+   lltop-serv-cts --socket=PATH --query=SECONDS asks and prints the
+   answer. */
+
+#define QUERY_TIMEOUT 10 /* Seconds to wait on a client. */
+
+static int query_listen(const char *path)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  struct stat st;
+  int fd;
+
+  if (strlen(path) >= sizeof(addr.sun_path))
+    FATAL("socket path `%s' too long\n", path);
+  strcpy(addr.sun_path, path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    FATAL("cannot create socket: %m\n");
+
+  /* Clear out the socket of a daemon that's gone. */
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode) &&
+      connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+    unlink(path);
+
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+    FATAL("cannot bind to `%s': %m\n", path);
+
+  if (listen(fd, 64) < 0)
+    FATAL("cannot listen on `%s': %m\n", path);
+
+  return fd;
+}
+
+static void query_answer(int fd, unsigned int gen, int intvl, int send_all)
+{
+  struct timeval tv = { .tv_sec = QUERY_TIMEOUT };
+  char line[80];
+  size_t len = 0;
+  ssize_t rc;
+  FILE *file;
+  int secs;
+
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+  while (len < sizeof(line) - 1 && memchr(line, '\n', len) == NULL) {
+    rc = read(fd, line + len, sizeof(line) - 1 - len);
+    if (rc <= 0) {
+      TRACE("cannot read query: %m\n");
+      close(fd);
+      return;
+    }
+    len += rc;
+  }
+  line[len] = 0;
+
+  file = fdopen(fd, "w");
+  if (file == NULL) {
+    ERROR("cannot open client stream: %m\n");
+    close(fd);
+    return;
+  }
+
+  if (sscanf(line, "%d", &secs) != 1 || secs <= 0 || secs % intvl != 0 ||
+      secs / intvl > nr_slots) {
+    fprintf(file, "invalid window `%s'\n", chop(line, '\n'));
     goto out;
   }
 
-  struct dirent *de;
-  while ((de = readdir(exp_dir)) != NULL) {
-    if (de_is_subdir(de))
-      read_client_stats(de->d_name, gen);
+  unsigned int nr = secs / intvl;
+  fprintf(file, "ok %u\n", intvl * (nr <= gen ? nr : gen));
+
+  size_t i = 0;
+  struct dict_entry *de;
+  while ((de = dict_for_each_ref(&name_stats_dict, &i)) != NULL) {
+    struct name_stats *ns = key_ns(de->d_key);
+    long wr, rd, reqs;
+
+    window_sum(ns, gen, nr, &wr, &rd, &reqs);
+
+    /* As for the interval, skip evicted and idle clients. */
+    if (!send_all && (wr < 0 || rd < 0 || reqs < 0))
+      continue;
+
+    if (!send_all && wr == 0 && rd == 0 && reqs == 0)
+      continue;
+
+    fprintf(file, "%s %ld %ld %ld\n", ns->ns_name, wr, rd, reqs);
   }
 
  out:
-  if (exp_dir != NULL)
-    closedir(exp_dir);
+  fclose(file);
+}
+
+static void wait_gen(const struct timespec *deadline, int qfd,
+                     unsigned int gen, int intvl, int send_all)
+{
+  /* Sleep until deadline, answering queries on qfd (if >= 0). */
+  struct timespec now;
+
+  if (qfd < 0) {
+    errno = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL);
+    if (errno != 0)
+      FATAL("cannot sleep: %m\n");
+    return;
+  }
+
+  while (1) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long ms = (deadline->tv_sec - now.tv_sec) * 1000 +
+      (deadline->tv_nsec - now.tv_nsec + 999999) / 1000000;
+    if (ms <= 0)
+      return;
+
+    struct pollfd pfd = { .fd = qfd, .events = POLLIN };
+    if (poll(&pfd, 1, ms) < 0) {
+      if (errno == EINTR)
+        continue;
+      FATAL("cannot poll query socket: %m\n");
+    }
+
+    if (pfd.revents & POLLIN) {
+      int fd = accept4(qfd, NULL, NULL, SOCK_CLOEXEC);
+      if (fd < 0)
+        ERROR("cannot accept query: %m\n");
+      else
+        query_answer(fd, gen, intvl, send_all);
+    }
+  }
+}
+
+static int query(const char *path, int secs)
+{
+  /* Ask the daemon at path for the load over secs seconds, print it. */
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  char buf[4096];
+  size_t len = 0;
+  ssize_t rc;
+  int fd;
+
+  if (strlen(path) >= sizeof(addr.sun_path))
+    FATAL("socket path `%s' too long\n", path);
+  strcpy(addr.sun_path, path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+    FATAL("cannot connect to `%s': %m\n", path);
+
+  int n = snprintf(buf, sizeof(buf), "%d\n", secs);
+  if (write(fd, buf, n) != n)
+    FATAL("cannot send query to `%s': %m\n", path);
+
+  /* Read the answer line a byte at a time, to leave the rest. */
+  while (len < sizeof(buf) - 1 && (len == 0 || buf[len - 1] != '\n')) {
+    rc = read(fd, buf + len, 1);
+    if (rc <= 0)
+      FATAL("cannot read from `%s': %m\n", path);
+    len++;
+  }
+  buf[len] = 0;
+
+  unsigned int seen;
+  if (sscanf(buf, "ok %u", &seen) != 1)
+    FATAL("`%s' says: %s", path, buf);
+
+  if (seen < secs)
+    ERROR("only %u of %d seconds seen so far\n", seen, secs);
 
+  while ((rc = read(fd, buf, sizeof(buf))) != 0) {
+    if (rc < 0) {
+      if (errno == EINTR)
+        continue;
+      FATAL("cannot read from `%s': %m\n", path);
+    }
+    if (write(1, buf, rc) != rc)
+      FATAL("cannot write output: %m\n");
+  }
+
+  close(fd);
   return 0;
 }
 
+static int get_window_list(const char *arg)
+{
+  /* Parse --windows=SECONDS,... */
+  char *list = strdup(arg), *pos = list, *tok;
+  int rc = 0;
+
+  if (list == NULL)
+    FATAL("out of memory\n");
+
+  nr_windows = 0;
+  while ((tok = strsep(&pos, ",")) != NULL) {
+    if (nr_windows == MAX_WINDOWS || (window_vec[nr_windows++] = atoi(tok)) <= 0) {
+      rc = -1;
+      break;
+    }
+  }
+  free(list);
+
+  return rc;
+}
+
+static void raise_nofile_limit(void)
+{
+  /* We keep one fd open per export, so take all we can get. */
+  struct rlimit rl;
+
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+      ERROR("cannot raise open file limit: %m\n");
+  }
+}
+
 int main(int argc, char *argv[])
 {
   int daemonize = 0;
   int send_all = 0;
+  int query_secs = 0;
+  int rescan_arg;
+  const char *socket_path = NULL;
+  int qfd = -1;
+  int use_job_stats = 0;
   int intvl = DEFAULT_LLTOP_INTVL;
   char *host_arg = NULL, *port_arg = LLTOP_PORT;
+  const char *counters_path = NULL;
   int sfd = -1;
   struct msg_buf mb;
   char mb_buf[LLTOP_MSG_MAX];
 
   struct option opts[] = {
     { "send-all", 0, NULL, 'a' },
+    { "counters", 1, NULL, 'c' },
     { "daemon", 0, NULL, 'd' },
     { "interval", 1, NULL, 'i' },
+    { "job-stats", 0, NULL, 'j' },
     { "port", 1, NULL, 'p' },
+    { "query", 1, NULL, 'q' },
+    { "rescan", 1, NULL, 'r' },
+    { "socket", 1, NULL, 's' },
+    { "windows", 1, NULL, 'w' },
     { NULL, 0, NULL, 0 },
   };
 
   int c;
-  while ((c = getopt_long(argc, argv, "adi:p:", opts, 0)) > 0) {
+  while ((c = getopt_long(argc, argv, "ac:di:jp:q:r:s:w:", opts, 0)) > 0) {
     switch (c) {
     case 'a':
       send_all = 1;
       continue;
+    case 'c':
+      counters_path = optarg;
+      continue;
     case 'd':
       daemonize = 1;
       continue;
@@ -308,19 +826,70 @@ int main(int argc, char *argv[])
       if (intvl <= 0)
         FATAL("invalid sleep interval `%s'\n", optarg);
       continue;
+    case 'j':
+      use_job_stats = 1;
+      continue;
     case 'p':
       port_arg = optarg;
       continue;
+    case 'q':
+      query_secs = atoi(optarg);
+      if (query_secs <= 0)
+        FATAL("invalid query window `%s'\n", optarg);
+      continue;
+    case 'r':
+      /* rescan_gens is unsigned, so check the sign first. */
+      rescan_arg = atoi(optarg);
+      if (rescan_arg <= 0)
+        FATAL("invalid rescan interval `%s'\n", optarg);
+      rescan_gens = rescan_arg;
+      continue;
+    case 's':
+      socket_path = optarg;
+      continue;
+    case 'w':
+      if (get_window_list(optarg) < 0)
+        FATAL("invalid window list `%s'\n", optarg);
+      continue;
     case '?':
       FATAL("invalid option\n");
     }
   }
 
-  if (argc - optind <= 0) {
-    fprintf(stderr, "Usage: %s [OPTIONS] HOST\n", program_invocation_short_name);
+  if (query_secs > 0) {
+    if (socket_path == NULL)
+      FATAL("--query needs --socket\n");
+    return query(socket_path, query_secs);
+  }
+
+  /* The ring covers the longest window.  Each window must be a whole
+     number of generations. */
+  int i;
+  for (i = 0; i < nr_windows; i++) {
+    if (window_vec[i] % intvl != 0)
+      FATAL("window %d is not a multiple of the interval %d\n", window_vec[i], intvl);
+    if (window_vec[i] / intvl > nr_slots)
+      nr_slots = window_vec[i] / intvl;
+  }
+
+  if (argc - optind <= 0 && socket_path == NULL) {
+    fprintf(stderr, "Usage: %s [OPTIONS] HOST\n"
+            "  or:  %s [OPTIONS] --socket=PATH [HOST]\n"
+            "  or:  %s --socket=PATH --query=SECONDS\n",
+            program_invocation_short_name, program_invocation_short_name,
+            program_invocation_short_name);
     exit(1);
   }
-  host_arg = argv[optind];
+  host_arg = argc - optind > 0 ? argv[optind] : NULL;
+
+  if (socket_path != NULL) {
+    qfd = query_listen(socket_path);
+    /* Clients may hang up on us. */
+    signal(SIGPIPE, SIG_IGN);
+  }
+
+  if (host_arg == NULL)
+    goto have_sfd;
 
   struct addrinfo hints, *list, *info;
   hints = (struct addrinfo) {
@@ -350,6 +919,7 @@ int main(int argc, char *argv[])
   if (msg_buf_init(&mb, sfd, mb_buf, sizeof(mb_buf)) < 0)
     FATAL("cannot create message buffer: %m\n");
 
+ have_sfd:
   if (get_target_list(&target_list, &nr_targets, "/proc/fs/lustre/mdt") < 0)
     exit(1);
 
@@ -359,9 +929,14 @@ int main(int argc, char *argv[])
   if (nr_targets == 0)
     FATAL("no targets found\n");
 
+  raise_nofile_limit();
+
   if (dict_init(&name_stats_dict, NR_CLIENTS_HINT) < 0)
     FATAL("cannot create client dictionary: %m\n");
 
+  if (stats_buf_init(&stats_buf, STATS_BUF_SIZE) < 0)
+    FATAL("cannot allocate stats buffer: %m\n");
+
   struct timespec intvl_spec;
   if (clock_gettime(CLOCK_MONOTONIC, &intvl_spec) < 0)
     FATAL("cannot get current time: %m\n");
@@ -372,33 +947,33 @@ int main(int argc, char *argv[])
   unsigned int gen;
   for (gen = 0; ; gen++) {
     int i;
-    for (i = 0; i < nr_targets; i++)
-      read_target_stats(&target_list[i], gen);
+    memset(&counters, 0, sizeof(counters));
+    for (i = 0; i < nr_targets; i++) {
+      if (use_job_stats)
+        read_target_job_stats(&target_list[i], gen);
+      else
+        read_target_stats(&target_list[i], gen);
+    }
+
+    TRACE("gen %u, exports %zu, opens %zu, opens avoided %zu, scans %zu\n",
+          gen, counters.c_exports, counters.c_opens, counters.c_opens_avoided,
+          counters.c_scans);
 
-    if (daemonize)
-      chdir("/");
+    if (counters_path != NULL)
+      write_counters(counters_path, gen);
 
-    if (gen == 0)
+    end_gen(gen);
+
+    if (gen == 0 || host_arg == NULL)
       goto sleep;
 
     size_t de_iter = 0;
     struct dict_entry *de;
     while ((de = dict_for_each_ref(&name_stats_dict, &de_iter)) != NULL) {
       struct name_stats *ns = key_ns(de->d_key);
-      long *s0, *s1, wr, rd, reqs;
-
-      if (ns->ns_gen != gen) {
-        TRACE("stale stats found for client `%s', removing\n", ns->ns_name);
-        dict_entry_remv(&name_stats_dict, de, 0);
-        free(ns);
-        continue;
-      }
+      long wr, rd, reqs;
 
-      s0 = ns->ns_stats[(gen - 1) % 2];
-      s1 = ns->ns_stats[gen % 2];
-      wr = s1[NS_WR] - s0[NS_WR];
-      rd = s1[NS_RD] - s0[NS_RD];
-      reqs = s1[NS_REQS] - s0[NS_REQS];
+      window_sum(ns, gen, 1, &wr, &rd, &reqs);
 
       /* If any stats are negative then we assume that the client was
          evicted while we slept, so we skip it. */
@@ -426,8 +1001,6 @@ int main(int argc, char *argv[])
 
   sleep:
     intvl_spec.tv_sec += intvl;
-    errno = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &intvl_spec, NULL);
-    if (errno != 0)
-      FATAL("cannot sleep: %m\n");
+    wait_gen(&intvl_spec, qfd, gen, intvl, send_all);
   }
 }
@@ -20,79 +20,73 @@
 /* TODO Error messages should include hostname. */
 #define _GNU_SOURCE
 #include <dirent.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include "lltop.h"
 #include "rbtree.h"
+#include "stats.h"
+#include "wire.h"
 
-const char *filter_path[2] = {
+const char *export_filter_path[2] = {
   "/proc/fs/lustre/mds",
   "/proc/fs/lustre/obdfilter",
 };
 
+/* With --job-stats we read one job_stats file per target instead of
+ * one stats file per export, and report by jobid instead of NID. */
+const char *job_stats_filter_path[2] = {
+  "/proc/fs/lustre/mdt",
+  "/proc/fs/lustre/obdfilter",
+};
+
+const char **filter_path = export_filter_path;
+int use_job_stats = 0;
+
 struct name_stats {
   struct rb_node ns_node;
   long ns_wr, ns_rd, ns_reqs;
   char ns_name[];
 };
 
-struct rb_root name_stats_root = RB_ROOT;
-
-int get_client_stats(const char *cli_name, int which)
-{
-  /* Parameter which is 0 or 1 depending on which pass we are in.  If
-   * which is 0 then subtract wr/rd/reqs from stats, otherwise add. */
-  TRACE("cli_name %s, which %d\n", cli_name, which);
-
-  char stats_path[80];
-  snprintf(stats_path, sizeof(stats_path), "%s/stats", cli_name);
-
-  FILE* stats_file = fopen(stats_path, "r");
-  if (stats_file == NULL) {
-    ERROR("cannot open %s: %m\n", stats_path);
-    return -1;
-  }
-
-  char *line = NULL;
-  size_t line_size = 0;
-
-  /* Skip first line with its busted snapshot_time. */
-  getline(&line, &line_size, stats_file);
-
-  long wr = 0, rd = 0, reqs = 0;
-
-  while (getline(&line, &line_size, stats_file) >= 0) {
-    char ctr_name[80];
-    long ctr_samples, ctr_sum = 0;
+struct target {
+  int t_type; /* Index into filter_path. */
+  int t_dir_fd; /* Open fd of filter_path[t_type]. */
+  char *t_name;
+};
 
-    /* XXX Do we need to check ctr_units? */
-    if (sscanf(line, "%79s %ld samples [%*[^]]] %*d %*d %ld",
-               ctr_name, &ctr_samples, &ctr_sum) < 2) {
-      ERROR("invalid line \"%s\"\n", chop(line, '\n'));
-      continue;
-    }
+struct target *target_list = NULL;
+size_t nr_targets = 0;
+size_t next_target = 0;
 
-    if (strcmp(ctr_name, "write_bytes") == 0) {
-      wr = ctr_sum;
-    } else if (strcmp(ctr_name, "read_bytes") == 0) {
-      rd = ctr_sum;
-    } else if (strcmp(ctr_name, "ping") != 0) { /* Ignore pings. */
-      reqs += ctr_samples;
-    }
-  }
-  free(line);
-  fclose(stats_file);
+/* Each scanner has its own stats buffer and its own tree of client
+ * stats, so that scanners never share anything but next_target.  The
+ * trees are merged after the last pass. */
+struct scanner {
+  pthread_t sc_thread;
+  struct rb_root sc_root;
+  struct stats_buf sc_buf;
+  int sc_which;
+};
 
-  /* Look up name_stats for cli_name. */
+struct name_stats *get_name_stats(struct rb_root *root, const char *cli_name)
+{
   struct name_stats *stats = NULL;
   struct rb_node **link, *parent;
 
-  link = &(name_stats_root.rb_node);
+  link = &(root->rb_node);
   parent = NULL;
 
   while (*link != NULL) {
@@ -105,7 +99,7 @@ int get_client_stats(const char *cli_name, int which)
     } else if (cmp > 0) {
       link = &((*link)->rb_right);
     } else {
-      goto have_stats;
+      return stats;
     }
   }
 
@@ -113,60 +107,966 @@ int get_client_stats(const char *cli_name, int which)
   stats = alloc(sizeof(*stats) + strlen(cli_name) + 1);
   memset(stats, 0, sizeof(*stats));
   rb_link_node(&stats->ns_node, parent, link);
-  rb_insert_color(&stats->ns_node, &name_stats_root);
+  rb_insert_color(&stats->ns_node, root);
   strcpy(stats->ns_name, cli_name);
 
- have_stats:
+  return stats;
+}
+
+int get_client_stats(struct scanner *sc, int exp_dir_fd, const char *cli_name)
+{
+  /* sc->sc_which is 0 or 1 depending on which pass we are in.  If
+   * which is 0 then subtract wr/rd/reqs from stats, otherwise add. */
+  int which = sc->sc_which;
+  TRACE("cli_name %s, which %d\n", cli_name, which);
+
+  char stats_path[80];
+  snprintf(stats_path, sizeof(stats_path), "%s/stats", cli_name);
+
+  long wr = 0, rd = 0, reqs = 0;
+  if (stats_read_at(&sc->sc_buf, exp_dir_fd, stats_path, &wr, &rd, &reqs) < 0)
+    return -1;
+
+  struct name_stats *stats = get_name_stats(&sc->sc_root, cli_name);
   stats->ns_wr += which ? wr : -wr;
   stats->ns_rd += which ? rd : -rd;
   stats->ns_reqs += which ? reqs : -reqs;
   return 0;
 }
 
-int get_target_stats(const char *tgt_name, int which)
+static void job_stats_cb(void *arg, const char *job, long wr, long rd, long reqs)
+{
+  struct scanner *sc = arg;
+  int which = sc->sc_which;
+
+  struct name_stats *stats = get_name_stats(&sc->sc_root, job);
+  stats->ns_wr += which ? wr : -wr;
+  stats->ns_rd += which ? rd : -rd;
+  stats->ns_reqs += which ? reqs : -reqs;
+}
+
+int get_target_job_stats(struct scanner *sc, struct target *tgt)
+{
+  TRACE("tgt_name %s, which %d\n", tgt->t_name, sc->sc_which);
+
+  char job_stats_path[80];
+  snprintf(job_stats_path, sizeof(job_stats_path), "%s/job_stats", tgt->t_name);
+
+  int fd = openat(tgt->t_dir_fd, job_stats_path, O_RDONLY);
+  if (fd < 0) {
+    ERROR("cannot open %s/%s: %m\n", filter_path[tgt->t_type], job_stats_path);
+    return -1;
+  }
+
+  ssize_t len = stats_buf_pread(&sc->sc_buf, fd);
+  if (len < 0) {
+    ERROR("cannot read %s/%s: %m\n", filter_path[tgt->t_type], job_stats_path);
+    close(fd);
+    return -1;
+  }
+  close(fd);
+
+  return stats_parse_jobs(sc->sc_buf.sb_buf, len, &job_stats_cb, sc);
+}
+
+int get_target_stats(struct scanner *sc, struct target *tgt)
 {
-  TRACE("tgt_name %s, which %d\n", tgt_name, which);
+  TRACE("tgt_name %s, which %d\n", tgt->t_name, sc->sc_which);
 
   char exp_dir_path[80];
-  snprintf(exp_dir_path, sizeof(exp_dir_path), "%s/exports", tgt_name);
+  snprintf(exp_dir_path, sizeof(exp_dir_path), "%s/exports", tgt->t_name);
 
-  if (chdir(exp_dir_path) < 0) {
-    ERROR("cannot open %s: %m\n", exp_dir_path);
+  int exp_dir_fd = openat(tgt->t_dir_fd, exp_dir_path, O_RDONLY|O_DIRECTORY);
+  if (exp_dir_fd < 0) {
+    ERROR("cannot open %s/%s: %m\n", filter_path[tgt->t_type], exp_dir_path);
     return -1;
   }
 
-  DIR *exp_dir = opendir(".");
+  DIR *exp_dir = fdopendir(exp_dir_fd);
   if (exp_dir == NULL)
-    FATAL("cannot open %s: %m\n", exp_dir_path);
+    FATAL("cannot open %s/%s: %m\n", filter_path[tgt->t_type], exp_dir_path);
 
   struct dirent *ent;
   while ((ent = readdir(exp_dir)) != NULL) {
     if (ent->d_type == DT_DIR && ent->d_name[0] != '.')
-      get_client_stats(ent->d_name, which);
+      get_client_stats(sc, exp_dir_fd, ent->d_name);
   }
   closedir(exp_dir);
 
   return 0;
 }
 
+void *scanner_main(void *arg)
+{
+  struct scanner *sc = arg;
+  size_t i;
+
+  while ((i = __sync_fetch_and_add(&next_target, 1)) < nr_targets) {
+    if (use_job_stats)
+      get_target_job_stats(sc, &target_list[i]);
+    else
+      get_target_stats(sc, &target_list[i]);
+  }
+
+  return NULL;
+}
+
+int get_target_list(int type)
+{
+  /* Append the targets under filter_path[type] to target_list.
+   * Returns 0 if the directory does not exist, 1 otherwise. */
+  int dir_fd = open(filter_path[type], O_RDONLY|O_DIRECTORY);
+  if (dir_fd < 0) {
+    if (errno != ENOENT)
+      FATAL("cannot open %s: %m\n", filter_path[type]);
+    return 0;
+  }
+
+  DIR *dir = fdopendir(dup(dir_fd));
+  if (dir == NULL)
+    FATAL("cannot open %s: %m\n", filter_path[type]);
+
+  size_t first = nr_targets;
+  struct dirent *ent;
+  while ((ent = readdir(dir)) != NULL) {
+    if (ent->d_type == DT_DIR && ent->d_name[0] != '.') {
+      target_list = realloc(target_list, (nr_targets + 1) * sizeof(target_list[0]));
+      if (target_list == NULL)
+        FATAL("out of memory\n");
+
+      target_list[nr_targets].t_type = type;
+      target_list[nr_targets].t_dir_fd = dir_fd;
+      target_list[nr_targets].t_name = strdup(ent->d_name);
+      if (target_list[nr_targets].t_name == NULL)
+        FATAL("out of memory\n");
+      nr_targets++;
+    }
+  }
+  closedir(dir);
+
+  /* free_target_list() closes dir_fd through our targets, if any. */
+  if (nr_targets == first)
+    close(dir_fd);
+
+  return 1;
+}
+
+void free_target_list(void)
+{
+  size_t i;
+  for (i = 0; i < nr_targets; i++) {
+    if (i == 0 || target_list[i].t_dir_fd != target_list[i - 1].t_dir_fd)
+      close(target_list[i].t_dir_fd);
+    free(target_list[i].t_name);
+  }
+  free(target_list);
+  target_list = NULL;
+  nr_targets = 0;
+  next_target = 0;
+}
+
+void merge_name_stats(struct rb_root *dest, struct rb_root *src)
+{
+  struct rb_node *node;
+  for (node = rb_first(src); node != NULL; node = rb_next(node)) {
+    struct name_stats *s = rb_entry(node, struct name_stats, ns_node);
+    struct name_stats *d = get_name_stats(dest, s->ns_name);
+    d->ns_wr += s->ns_wr;
+    d->ns_rd += s->ns_rd;
+    d->ns_reqs += s->ns_reqs;
+  }
+  rb_destroy(src, offsetof(struct name_stats, ns_node), &free);
+}
+
+static int wait_go(void)
+{
+  /* Tell lltop we're up and wait for its go-ahead on stdin, so that
+     servers started at different times still line up their intervals.
+     Returns -1 if lltop gave up on us. */
+  char line[80];
+
+  if (write(1, SERV_READY_LINE, strlen(SERV_READY_LINE)) < 0)
+    return -1;
+
+  if (fgets(line, sizeof(line), stdin) == NULL)
+    return -1;
+
+  return strcmp(line, SERV_GO_LINE) == 0 ? 0 : -1;
+}
+
+int scan_targets(struct scanner *scanners, int nr_scanners, int which)
+{
+  /* Run one pass over every target.  Returns the number of filter
+     dirs found. */
+  int i, type, found = 0;
+
+  for (type = 0; type < 2; type++)
+    found += get_target_list(type);
+
+  /* The main thread does the work of scanner 0. */
+  for (i = 0; i < nr_scanners; i++)
+    scanners[i].sc_which = which;
+
+  for (i = 1; i < nr_scanners; i++) {
+    errno = pthread_create(&scanners[i].sc_thread, NULL, &scanner_main, &scanners[i]);
+    if (errno != 0)
+      FATAL("cannot create thread: %m\n");
+  }
+
+  scanner_main(&scanners[0]);
+
+  for (i = 1; i < nr_scanners; i++)
+    pthread_join(scanners[i].sc_thread, NULL);
+
+  free_target_list();
+
+  return found;
+}
+
+int write_name_stats(struct rb_root *root, FILE *file, struct wire_buf *wb, int binary)
+{
+  struct rb_node *node;
+
+  /* Binary output bypasses file. */
+  if (binary && (fputs(SERV_BINARY_LINE, file) < 0 || fflush(file) != 0))
+    return -1;
+
+  for (node = rb_first(root); node != NULL; node = rb_next(node)) {
+    struct name_stats *s = rb_entry(node, struct name_stats, ns_node);
+
+    /* If any stats are negative then we assume that the client was
+       evicted while we slept, so we skip it. */
+    if (s->ns_wr < 0 || s->ns_rd < 0 || s->ns_reqs < 0) {
+      TRACE("skipping %s %ld %ld %ld\n", s->ns_name, s->ns_wr, s->ns_rd, s->ns_reqs);
+      continue;
+    }
+
+    /* As an optimization, skip this client if all stats are zero. */
+    if (s->ns_wr == 0 && s->ns_rd == 0 && s->ns_reqs == 0) {
+      TRACE("skipping %s %ld %ld %ld\n", s->ns_name, s->ns_wr, s->ns_rd, s->ns_reqs);
+      continue;
+    }
+
+    if (!binary)
+      fprintf(file, "%s %ld %ld %ld\n", s->ns_name, s->ns_wr, s->ns_rd, s->ns_reqs);
+    else if (wire_buf_put(wb, s->ns_name, !use_job_stats,
+                          s->ns_wr, s->ns_rd, s->ns_reqs) < 0) {
+      if (errno != ENAMETOOLONG)
+        return -1;
+      ERROR("skipping client `%s': name too long\n", s->ns_name);
+    }
+  }
+
+  if (binary)
+    return wire_buf_flush(wb);
+
+  return fflush(file) == 0 && !ferror(file) ? 0 : -1;
+}
+
+/* With --agent=SOCKET we keep scanning every interval, keep the
+   latest two scans as baselines, and answer each connection to
+   SOCKET with the load since a baseline, scanning again to get it.
+   lltop-serv --socket=SOCKET is the client; lltop runs it over ssh
+   like any lltop-serv.  The request is one line,
+
+     FORMAT MODE INTERVAL
+
+   where FORMAT is text or binary, MODE is exports or job-stats, and
+   INTERVAL is the client's --interval.  The agent answers "ok" and
+   the usual output, or a line saying why not and nothing else.  The
+   load is scaled from the baseline's age to INTERVAL seconds, so that
+   the numbers mean what they would without the agent. */
+
+#define AGENT_OK_LINE "ok\n"
+#define AGENT_BACKLOG 64
+#define AGENT_TIMEOUT 10 /* Seconds to wait on a client. */
+
+struct snapshot {
+  struct rb_root sn_root;
+  struct timespec sn_time;
+  int sn_valid;
+};
+
+static double timespec_diff(const struct timespec *t1, const struct timespec *t0)
+{
+  return (t1->tv_sec - t0->tv_sec) + (t1->tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+static int snapshot_take(struct snapshot *sn, struct scanner *scanners, int nr_scanners)
+{
+  /* Replace sn with the current totals of every client.  Returns the
+     number of filter dirs found. */
+  int i, found;
+
+  if (sn->sn_valid)
+    rb_destroy(&sn->sn_root, offsetof(struct name_stats, ns_node), &free);
+
+  clock_gettime(CLOCK_MONOTONIC, &sn->sn_time);
+  found = scan_targets(scanners, nr_scanners, 1);
+  if (found == 0) {
+    errno = ENOENT;
+    ERROR("cannot access %s or %s: %m\n", filter_path[0], filter_path[1]);
+  }
+
+  for (i = 1; i < nr_scanners; i++)
+    merge_name_stats(&scanners[0].sc_root, &scanners[i].sc_root);
+
+  sn->sn_root = scanners[0].sc_root;
+  sn->sn_valid = 1;
+  scanners[0].sc_root = RB_ROOT;
+
+  return found;
+}
+
+static void snapshot_diff(struct rb_root *dest, struct snapshot *cur,
+                          struct snapshot *base, double scale)
+{
+  /* Put the load from base to cur, times scale, into dest.  Clients
+     that went away come out negative and get skipped on output. */
+  struct rb_node *node;
+  for (node = rb_first(&cur->sn_root); node != NULL; node = rb_next(node)) {
+    struct name_stats *c = rb_entry(node, struct name_stats, ns_node);
+    struct name_stats *d = get_name_stats(dest, c->ns_name);
+    d->ns_wr += c->ns_wr;
+    d->ns_rd += c->ns_rd;
+    d->ns_reqs += c->ns_reqs;
+  }
+
+  for (node = rb_first(&base->sn_root); node != NULL; node = rb_next(node)) {
+    struct name_stats *b = rb_entry(node, struct name_stats, ns_node);
+    struct name_stats *d = get_name_stats(dest, b->ns_name);
+    d->ns_wr -= b->ns_wr;
+    d->ns_rd -= b->ns_rd;
+    d->ns_reqs -= b->ns_reqs;
+  }
+
+  if (scale == 1)
+    return;
+
+  for (node = rb_first(dest); node != NULL; node = rb_next(node)) {
+    struct name_stats *d = rb_entry(node, struct name_stats, ns_node);
+    d->ns_wr *= scale;
+    d->ns_rd *= scale;
+    d->ns_reqs *= scale;
+  }
+}
+
+static void agent_answer(int fd, struct snapshot *base_vec, int intvl,
+                         struct scanner *scanners, int nr_scanners)
+{
+  struct timeval tv = { .tv_sec = AGENT_TIMEOUT };
+  char line[80], format[16], mode[16];
+  size_t len = 0;
+  ssize_t rc;
+  int binary, req_intvl;
+  FILE *file = NULL;
+
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+  while (len < sizeof(line) - 1 && memchr(line, '\n', len) == NULL) {
+    rc = read(fd, line + len, sizeof(line) - 1 - len);
+    if (rc <= 0) {
+      TRACE("cannot read request: %m\n");
+      goto out;
+    }
+    len += rc;
+  }
+  line[len] = 0;
+
+  file = fdopen(fd, "w");
+  if (file == NULL) {
+    ERROR("cannot open client stream: %m\n");
+    goto out;
+  }
+  fd = -1;
+
+  if (sscanf(line, "%15s %15s %d", format, mode, &req_intvl) != 3 ||
+      (strcmp(format, "text") != 0 && strcmp(format, "binary") != 0) ||
+      req_intvl <= 0) {
+    fprintf(file, "invalid request\n");
+    goto out;
+  }
+  binary = strcmp(format, "binary") == 0;
+
+  if (strcmp(mode, use_job_stats ? "job-stats" : "exports") != 0) {
+    fprintf(file, "agent is not in %s mode\n", mode);
+    goto out;
+  }
+
+  /* Use the newest baseline that is at least half an interval old.
+   * A younger one would scale a moment's load up to the whole
+   * interval, so right after we start, send the client off to do its
+   * own two scans instead. */
+  struct snapshot cur = { .sn_valid = 0 }, *base = NULL;
+  int i;
+  snapshot_take(&cur, scanners, nr_scanners);
+  for (i = 0; i < 2 && base == NULL; i++)
+    if (base_vec[i].sn_valid &&
+        timespec_diff(&cur.sn_time, &base_vec[i].sn_time) >= intvl / 2.0)
+      base = &base_vec[i];
+
+  if (base == NULL) {
+    rb_destroy(&cur.sn_root, offsetof(struct name_stats, ns_node), &free);
+    fprintf(file, "warming up\n");
+    goto out;
+  }
+
+  double age = timespec_diff(&cur.sn_time, &base->sn_time);
+  double scale = age > 0 ? req_intvl / age : 1;
+  TRACE("baseline age %f, scale %f\n", age, scale);
+
+  struct rb_root delta = RB_ROOT;
+  snapshot_diff(&delta, &cur, base, scale);
+  rb_destroy(&cur.sn_root, offsetof(struct name_stats, ns_node), &free);
+
+  struct wire_buf wire_buf;
+  wire_buf_init(&wire_buf, fileno(file));
+
+  /* Binary output bypasses file. */
+  fputs(AGENT_OK_LINE, file);
+  fflush(file);
+  if (write_name_stats(&delta, file, &wire_buf, binary) < 0)
+    TRACE("cannot write to client: %m\n");
+
+  rb_destroy(&delta, offsetof(struct name_stats, ns_node), &free);
+
+ out:
+  if (file != NULL)
+    fclose(file);
+  if (fd >= 0)
+    close(fd);
+}
+
+static void agent_main(const char *path, int intvl,
+                       struct scanner *scanners, int nr_scanners)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  struct snapshot base_vec[2];
+  struct timespec next, now;
+  struct stat st;
+  mode_t mask;
+  int lfd, rc;
+
+  if (strlen(path) >= sizeof(addr.sun_path))
+    FATAL("socket path `%s' too long\n", path);
+  strcpy(addr.sun_path, path);
+
+  lfd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+  if (lfd < 0)
+    FATAL("cannot create socket: %m\n");
+
+  /* Clear out the socket of an agent that's gone. */
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode) &&
+      connect(lfd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+    unlink(path);
+
+  /* Let the socket's group connect, whatever our umask, as with
+     --share.  No scanners are running yet to mind the umask. */
+  mask = umask(0002);
+  rc = bind(lfd, (struct sockaddr *) &addr, sizeof(addr));
+  umask(mask);
+  if (rc < 0)
+    FATAL("cannot bind to `%s': %m\n", path);
+
+  if (listen(lfd, AGENT_BACKLOG) < 0)
+    FATAL("cannot listen on `%s': %m\n", path);
+
+  /* Clients may hang up on us. */
+  signal(SIGPIPE, SIG_IGN);
+
+  memset(base_vec, 0, sizeof(base_vec));
+  clock_gettime(CLOCK_MONOTONIC, &next);
+
+  while (1) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (timespec_diff(&now, &next) >= 0) {
+      /* Age out the older baseline, take a new one. */
+      struct snapshot sn = base_vec[1];
+      base_vec[1] = base_vec[0];
+      base_vec[0] = sn;
+      snapshot_take(&base_vec[0], scanners, nr_scanners);
+      next.tv_sec += intvl;
+      continue;
+    }
+
+    struct pollfd pfd = { .fd = lfd, .events = POLLIN };
+    int ms = 1000 * timespec_diff(&next, &now) + 1;
+    if (poll(&pfd, 1, ms) < 0) {
+      if (errno == EINTR)
+        continue;
+      FATAL("cannot poll `%s': %m\n", path);
+    }
+
+    if (pfd.revents & POLLIN) {
+      int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+      if (fd < 0) {
+        ERROR("cannot accept on `%s': %m\n", path);
+        continue;
+      }
+      agent_answer(fd, base_vec, intvl, scanners, nr_scanners);
+    }
+  }
+}
+
+static int ask_agent(const char *path, int binary, int intvl)
+{
+  /* Get our output from the agent at path, and copy it to stdout.
+     Returns -1 (having written nothing) if the agent can't help. */
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  char buf[4096];
+  size_t len = 0;
+  ssize_t rc;
+  int fd;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    ERROR("socket path `%s' too long\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+
+  if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    TRACE("cannot connect to agent at `%s': %m\n", path);
+    goto err;
+  }
+
+  int n = snprintf(buf, sizeof(buf), "%s %s %d\n", binary ? "binary" : "text",
+                   use_job_stats ? "job-stats" : "exports", intvl);
+  if (write(fd, buf, n) != n)
+    goto err;
+
+  /* Read the answer line a byte at a time, to leave the rest. */
+  while (len < sizeof(buf) - 1 && (len == 0 || buf[len - 1] != '\n')) {
+    rc = read(fd, buf + len, 1);
+    if (rc <= 0)
+      goto err;
+    len++;
+  }
+  buf[len] = 0;
+
+  if (strcmp(buf, AGENT_OK_LINE) != 0) {
+    ERROR("agent at `%s' says: %s", path, buf);
+    goto err;
+  }
+
+  while ((rc = read(fd, buf, sizeof(buf))) != 0) {
+    if (rc < 0) {
+      if (errno == EINTR)
+        continue;
+      FATAL("cannot read from agent at `%s': %m\n", path);
+    }
+    if (write(1, buf, rc) != rc)
+      FATAL("cannot write output: %m\n");
+  }
+
+  close(fd);
+  return 0;
+
+ err:
+  close(fd);
+  return -1;
+}
+
+/* A snapshot file is a snapshot_header and then the snapshot's
+   counters as wire frames (see wire.h).  A file from another boot or
+   mode is ignored. */
+
+#define SNAPSHOT_MAGIC "lltopbl1"
+
+struct snapshot_header {
+  char bh_magic[8];
+  char bh_boot_id[40];
+  int64_t bh_sec, bh_nsec; /* CLOCK_MONOTONIC. */
+  int32_t bh_job_stats;
+  int32_t bh_pad;
+};
+
+static void get_boot_id(char *buf, size_t size)
+{
+  /* The monotonic clock means nothing across boots. */
+  FILE *file = fopen("/proc/sys/kernel/random/boot_id", "r");
+
+  memset(buf, 0, size);
+  if (file == NULL)
+    return;
+  if (fgets(buf, size, file) == NULL)
+    memset(buf, 0, size);
+  fclose(file);
+}
+
+static void snapshot_rec(void *arg, struct wire_rec *rec)
+{
+  struct name_stats *s = get_name_stats(arg, rec->r_name);
+  s->ns_wr += rec->r_wr;
+  s->ns_rd += rec->r_rd;
+  s->ns_reqs += rec->r_reqs;
+}
+
+static int snapshot_read(const char *path, struct snapshot *sn)
+{
+  /* Load the snapshot file at path into sn, if it's any good. */
+  struct snapshot_header bh;
+  char boot_id[sizeof(bh.bh_boot_id)];
+  struct stat st;
+  char *buf = NULL;
+  size_t len, used, nr_bad = 0;
+  int fd, rc = -1;
+
+  fd = open(path, O_RDONLY|O_CLOEXEC);
+  if (fd < 0) {
+    TRACE("cannot open `%s': %m\n", path);
+    return -1;
+  }
+
+  if (fstat(fd, &st) < 0 || st.st_size < sizeof(bh))
+    goto out;
+
+  len = st.st_size;
+  buf = alloc(len);
+  if (pread(fd, buf, len, 0) != len)
+    goto out;
+
+  memcpy(&bh, buf, sizeof(bh));
+  get_boot_id(boot_id, sizeof(boot_id));
+  if (memcmp(bh.bh_magic, SNAPSHOT_MAGIC, sizeof(bh.bh_magic)) != 0 ||
+      memcmp(bh.bh_boot_id, boot_id, sizeof(boot_id)) != 0 ||
+      bh.bh_job_stats != use_job_stats) {
+    TRACE("`%s' is not for this boot or mode\n", path);
+    goto out;
+  }
+
+  sn->sn_time.tv_sec = bh.bh_sec;
+  sn->sn_time.tv_nsec = bh.bh_nsec;
+  sn->sn_root = RB_ROOT;
+  used = wire_decode(buf + sizeof(bh), len - sizeof(bh), &snapshot_rec,
+                     &sn->sn_root, &nr_bad);
+  if (used != len - sizeof(bh) || nr_bad > 0) {
+    ERROR("ignoring corrupt snapshot file `%s'\n", path);
+    rb_destroy(&sn->sn_root, offsetof(struct name_stats, ns_node), &free);
+    goto out;
+  }
+
+  sn->sn_valid = 1;
+  rc = 0;
+
+ out:
+  free(buf);
+  close(fd);
+
+  return rc;
+}
+
+static int snapshot_write(const char *path, struct snapshot *sn)
+{
+  /* Replace the snapshot file at path with sn. */
+  struct snapshot_header bh;
+  struct wire_buf wire_buf;
+  struct rb_node *node;
+  char *tmp_path = NULL;
+  int fd = -1, rc = -1;
+
+  memset(&bh, 0, sizeof(bh));
+  memcpy(bh.bh_magic, SNAPSHOT_MAGIC, sizeof(bh.bh_magic));
+  get_boot_id(bh.bh_boot_id, sizeof(bh.bh_boot_id));
+  bh.bh_sec = sn->sn_time.tv_sec;
+  bh.bh_nsec = sn->sn_time.tv_nsec;
+  bh.bh_job_stats = use_job_stats;
+
+  if (asprintf(&tmp_path, "%s.%d", path, (int) getpid()) < 0) {
+    tmp_path = NULL;
+    goto out;
+  }
+
+  fd = open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+  if (fd < 0)
+    goto out;
+
+  if (write(fd, &bh, sizeof(bh)) != sizeof(bh))
+    goto out;
+
+  wire_buf_init(&wire_buf, fd);
+  for (node = rb_first(&sn->sn_root); node != NULL; node = rb_next(node)) {
+    struct name_stats *s = rb_entry(node, struct name_stats, ns_node);
+    if (wire_buf_put(&wire_buf, s->ns_name, 0, s->ns_wr, s->ns_rd, s->ns_reqs) < 0 &&
+        errno != ENAMETOOLONG)
+      goto out;
+  }
+
+  if (wire_buf_flush(&wire_buf) < 0)
+    goto out;
+
+  if (close(fd) < 0) {
+    fd = -1;
+    goto out;
+  }
+  fd = -1;
+
+  rc = rename(tmp_path, path);
+
+ out:
+  if (rc < 0) {
+    ERROR("cannot write `%s': %m\n", path);
+    if (tmp_path != NULL)
+      unlink(tmp_path);
+  }
+  if (fd >= 0)
+    close(fd);
+  free(tmp_path);
+
+  return rc;
+}
+
+/* With --baseline=PATH we save our last totals in PATH as a snapshot
+   file, and the next run uses them in place of its first scan, so it
+   need not sleep.  A baseline more than BASELINE_MAX_INTVLS intervals
+   old is ignored.  We wait out the rest of the interval if the
+   baseline is younger than that, and scale the load to the interval
+   if it's older. */
+
+#define BASELINE_MAX_INTVLS 6
+
+static void baseline_scan(const char *path, int intvl,
+                          struct scanner *scanners, int nr_scanners,
+                          struct rb_root *delta)
+{
+  struct snapshot base = { .sn_valid = 0 }, cur = { .sn_valid = 0 };
+  struct timespec deadline, now;
+  int have_file, slept = 0;
+  double scale = 1;
+
+  have_file = snapshot_read(path, &base) == 0;
+  if (have_file) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double age = timespec_diff(&now, &base.sn_time);
+    if (age < 0 || age > BASELINE_MAX_INTVLS * intvl) {
+      TRACE("baseline `%s' is %f seconds old\n", path, age);
+      rb_destroy(&base.sn_root, offsetof(struct name_stats, ns_node), &free);
+      base.sn_valid = have_file = 0;
+    }
+  }
+
+  if (!have_file && snapshot_take(&base, scanners, nr_scanners) == 0)
+    exit(1);
+
+  /* Cover at least the interval. */
+  deadline = base.sn_time;
+  deadline.tv_sec += intvl;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (timespec_diff(&deadline, &now) > 0) {
+    errno = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+    if (errno != 0)
+      FATAL("clock_nanosleep() failed: %m\n");
+    slept = 1;
+  }
+
+  if (snapshot_take(&cur, scanners, nr_scanners) == 0)
+    exit(1);
+
+  if (have_file && !slept)
+    scale = intvl / timespec_diff(&cur.sn_time, &base.sn_time);
+  TRACE("baseline from %s, scale %f\n", have_file ? "file" : "scan", scale);
+
+  snapshot_diff(delta, &cur, &base, scale);
+  snapshot_write(path, &cur);
+
+  rb_destroy(&base.sn_root, offsetof(struct name_stats, ns_node), &free);
+  rb_destroy(&cur.sn_root, offsetof(struct name_stats, ns_node), &free);
+}
+
+/* With --share=DIR, runs with the same interval and mode share one
+   scan.  The first takes an exclusive flock() on DIR/MODE-INTERVAL.lock
+   and writes a stamp there.  It scans as usual and saves its result as
+   a snapshot file, DIR/MODE-INTERVAL.result, whose time is the stamp.
+   Then it clears the stamp and unlocks.  A run that finds the lock
+   taken reads the stamp and waits for a shared lock.  It then uses the
+   result if the result has the same stamp, and scans for itself if
+   not. */
+
+#define SHARE_TRIES 100 /* Times to look for a stamp, 10 ms apart. */
+
+static int share_fd = -1; /* Lock, if we're the one scanning. */
+static char *share_result_path;
+static struct timespec share_stamp;
+
+static int share_join(const char *dir, int intvl, struct rb_root *result)
+{
+  /* Returns 0 with the shared result in result, or -1 if we have to
+     scan for ourselves (and then share_fd >= 0 if we should share). */
+  const char *mode = use_job_stats ? "job-stats" : "exports";
+  struct snapshot sn = { .sn_valid = 0 };
+  char *lock_path = NULL, buf[80];
+  int fd = -1, tries = 0, rc = -1;
+  ssize_t len;
+
+  if (asprintf(&lock_path, "%s/%s-%d.lock", dir, mode, intvl) < 0 ||
+      asprintf(&share_result_path, "%s/%s-%d.result", dir, mode, intvl) < 0)
+    FATAL("out of memory\n");
+
+  /* Everyone in dir's group shares, whatever their umask.  The
+     setgid bit gives new files the dir's group. */
+  if (mkdir(dir, 0775) == 0) {
+    if (chmod(dir, 02775) < 0)
+      goto err;
+  } else if (errno != EEXIST) {
+    goto err;
+  }
+
+  fd = open(lock_path, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, 0664);
+  if (fd >= 0) {
+    if (fchmod(fd, 0664) < 0)
+      goto err;
+  } else if (errno == EEXIST) {
+    fd = open(lock_path, O_RDWR|O_CLOEXEC);
+  }
+  if (fd < 0)
+    goto err;
+
+  while (1) {
+    if (flock(fd, LOCK_EX|LOCK_NB) == 0) {
+      /* Our scan. */
+      clock_gettime(CLOCK_MONOTONIC, &share_stamp);
+      len = snprintf(buf, sizeof(buf), "%ld %ld\n",
+                     (long) share_stamp.tv_sec, share_stamp.tv_nsec);
+      if (ftruncate(fd, 0) < 0 || pwrite(fd, buf, len, 0) != len)
+        goto err;
+      share_fd = fd;
+      fd = -1;
+      goto out;
+    }
+
+    if (errno != EWOULDBLOCK)
+      goto err;
+
+    long sec, nsec;
+    len = pread(fd, buf, sizeof(buf) - 1, 0);
+    buf[len > 0 ? len : 0] = 0;
+    if (sscanf(buf, "%ld %ld", &sec, &nsec) == 2) {
+      sn.sn_time.tv_sec = sec;
+      sn.sn_time.tv_nsec = nsec;
+      break;
+    }
+
+    if (++tries == SHARE_TRIES) {
+      TRACE("no stamp in `%s'\n", lock_path);
+      goto out;
+    }
+    usleep(10000);
+  }
+
+  TRACE("waiting on scan %ld.%09ld\n", (long) sn.sn_time.tv_sec, sn.sn_time.tv_nsec);
+
+  while (flock(fd, LOCK_SH) < 0)
+    if (errno != EINTR)
+      goto err;
+
+  struct timespec stamp = sn.sn_time;
+  if (snapshot_read(share_result_path, &sn) < 0)
+    goto out;
+
+  if (sn.sn_time.tv_sec != stamp.tv_sec || sn.sn_time.tv_nsec != stamp.tv_nsec) {
+    TRACE("scan %ld.%09ld left no result\n", (long) stamp.tv_sec, stamp.tv_nsec);
+    rb_destroy(&sn.sn_root, offsetof(struct name_stats, ns_node), &free);
+    goto out;
+  }
+
+  *result = sn.sn_root;
+  rc = 0;
+  goto out;
+
+ err:
+  ERROR("cannot share scans through `%s': %m\n", lock_path);
+ out:
+  if (fd >= 0)
+    close(fd);
+  free(lock_path);
+
+  return rc;
+}
+
+static void share_publish(struct rb_root *result)
+{
+  /* Give our result to those waiting on our scan, and unlock. */
+  struct snapshot sn = { .sn_root = *result, .sn_time = share_stamp, .sn_valid = 1 };
+
+  /* Whoever waits may have another uid in dir's group.  No one reads
+     the result before we unlock. */
+  if (snapshot_write(share_result_path, &sn) == 0 &&
+      chmod(share_result_path, 0664) < 0)
+    ERROR("cannot chmod `%s': %m\n", share_result_path);
+
+  if (ftruncate(share_fd, 0) < 0)
+    ERROR("cannot clear scan stamp: %m\n");
+
+  close(share_fd);
+  share_fd = -1;
+}
+
 int main(int argc, char *argv[])
 {
   int intvl = DEFAULT_LLTOP_INTVL;
+  int nr_scanners = 1;
+  int binary = 0;
+  int ready = 0;
+  const char *agent_path = NULL, *socket_path = NULL, *baseline_path = NULL;
+  const char *share_dir = NULL;
+  struct wire_buf wire_buf;
   struct timespec intvl_spec;
 
   struct option opts[] = {
+    { "agent", 1, 0, 'a' },
+    { "baseline", 1, 0, 'b' },
     { "interval", 1, 0, 'i' },
+    { "format", 1, 0, 'f' },
+    { "job-stats", 0, 0, 'j' },
+    { "ready", 0, 0, 'r' },
+    { "share", 1, 0, 'S' },
+    { "socket", 1, 0, 's' },
+    { "threads", 1, 0, 't' },
     { 0, 0, 0, 0},
   };
 
   int c;
-  while ((c = getopt_long(argc, argv, "i:", opts, 0)) > 0) {
+  while ((c = getopt_long(argc, argv, "a:b:f:i:jrS:s:t:", opts, 0)) > 0) {
     switch (c) {
+    case 'a':
+      agent_path = optarg;
+      continue;
+    case 'b':
+      baseline_path = optarg;
+      continue;
+    case 'f':
+      if (strcmp(optarg, "binary") == 0)
+        binary = 1;
+      else if (strcmp(optarg, "text") != 0)
+        FATAL("invalid format \"%s\"\n", optarg);
+      continue;
     case 'i':
       intvl = atoi(optarg);
       if (intvl <= 0)
         FATAL("invalid sleep interval \"%s\"\n", optarg);
       continue;
+    case 'j':
+      use_job_stats = 1;
+      filter_path = job_stats_filter_path;
+      continue;
+    case 'r':
+      ready = 1;
+      continue;
+    case 'S':
+      share_dir = optarg;
+      continue;
+    case 's':
+      socket_path = optarg;
+      continue;
+    case 't':
+      nr_scanners = atoi(optarg);
+      if (nr_scanners <= 0)
+        FATAL("invalid number of threads \"%s\"\n", optarg);
+      continue;
     case '?':
       FATAL("invalid option\n");
     }
@@ -176,13 +1076,44 @@ int main(int argc, char *argv[])
    * don't clobber each other.  Can't find a guarantee that ssh won't
    * break up writes, but it seems to work. */
   setlinebuf(stdout);
+  wire_buf_init(&wire_buf, 1);
+
+  struct scanner *scanners = alloc(nr_scanners * sizeof(scanners[0]));
+  int i;
+  for (i = 0; i < nr_scanners; i++) {
+    scanners[i].sc_root = RB_ROOT;
+    if (stats_buf_init(&scanners[i].sc_buf, STATS_BUF_SIZE) < 0)
+      FATAL("cannot allocate stats buffer: %m\n");
+  }
+
+  if (agent_path != NULL)
+    agent_main(agent_path, intvl, scanners, nr_scanners);
+
+  if (ready && wait_go() < 0) {
+    TRACE("no go-ahead from lltop, exiting\n");
+    return 0;
+  }
+
+  /* With --socket, the agent has our answer already, if it's up. */
+  if (socket_path != NULL && ask_agent(socket_path, binary, intvl) == 0)
+    return 0;
+
+  /* With --share, someone else may be scanning for us already. */
+  struct rb_root *result = &scanners[0].sc_root;
+  if (share_dir != NULL && share_join(share_dir, intvl, result) == 0)
+    goto out;
+
+  if (baseline_path != NULL) {
+    baseline_scan(baseline_path, intvl, scanners, nr_scanners, result);
+    goto have_result;
+  }
 
   if (clock_gettime(CLOCK_MONOTONIC, &intvl_spec) < 0)
     FATAL("cannot read monotonic clock: %m\n");
 
   TRACE("scanning stats files\n");
 
-  int which, type, found = 0;
+  int which, found = 0;
   for (which = 0; which < 2; which++) {
     /* Before we start pass 1, we wait until at least intvl seconds
        have elapsed since the start of pass 0. */
@@ -193,24 +1124,7 @@ int main(int argc, char *argv[])
         FATAL("clock_nanosleep() failed: %m\n");
     }
 
-    for (type = 0; type < 2; type++) {
-      DIR *dir = opendir(filter_path[type]);
-      if (dir == NULL) {
-        if (errno != ENOENT)
-          FATAL("cannot open %s: %m\n", filter_path[type]);
-        continue;
-      }
-      found++;
-
-      struct dirent *ent;
-      while ((ent = readdir(dir)) != NULL) {
-        if (ent->d_type == DT_DIR && ent->d_name[0] != '.') {
-          chdir(filter_path[type]);
-          get_target_stats(ent->d_name, which);
-        }
-      }
-      closedir(dir);
-    }
+    found += scan_targets(scanners, nr_scanners, which);
 
     /* At the end of pass 0, if neither dir exists then we bail. */
     if (found == 0) {
@@ -221,28 +1135,23 @@ int main(int argc, char *argv[])
 
   TRACE("done scanning stats files\n");
 
-  struct rb_node *node;
-  for (node = rb_first(&name_stats_root); node != NULL; node = rb_next(node)) {
-    struct name_stats *s = rb_entry(node, struct name_stats, ns_node);
-
-    /* If any stats are negative then we assume that the client was
-       evicted while we slept, so we skip it. */
-    if (s->ns_wr < 0 || s->ns_rd < 0 || s->ns_reqs < 0) {
-      TRACE("skipping %s %ld %ld %ld\n", s->ns_name, s->ns_wr, s->ns_rd, s->ns_reqs);
-      continue;
-    }
+  for (i = 1; i < nr_scanners; i++)
+    merge_name_stats(&scanners[0].sc_root, &scanners[i].sc_root);
 
-    /* As an optimization, skip this client if all stats are zero. */
-    if (s->ns_wr == 0 && s->ns_rd == 0 && s->ns_reqs == 0) {
-      TRACE("skipping %s %ld %ld %ld\n", s->ns_name, s->ns_wr, s->ns_rd, s->ns_reqs);
-      continue;
-    }
+ have_result:
+  if (share_fd >= 0)
+    share_publish(result);
 
-    printf("%s %ld %ld %ld\n", s->ns_name, s->ns_wr, s->ns_rd, s->ns_reqs);
-  }
+ out:
+  if (write_name_stats(result, stdout, &wire_buf, binary) < 0)
+    FATAL("cannot write output: %m\n");
 
 #ifdef DEBUG
-  rb_destroy(&name_stats_root, offsetof(struct name_stats, ns_node), &free);
+  for (i = 0; i < nr_scanners; i++) {
+    rb_destroy(&scanners[i].sc_root, offsetof(struct name_stats, ns_node), &free);
+    stats_buf_destroy(&scanners[i].sc_buf);
+  }
+  free(scanners);
 #endif
 
   return 0;
@@ -0,0 +1,140 @@
+/* lltop stats-bench.c
+ * Copyright 2010 by John L. Hammond <jhammond@tacc.utexas.edu>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA.
+ */
+/* Microbenchmark: time the old fopen/getline/sscanf stats parser
+   against stats_read_at() on a synthetic export stats file.
+   Usage: stats-bench [ITERATIONS] */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "lltop.h"
+#include "stats.h"
+
+static const char stats_text[] =
+  "snapshot_time             1289410216.487593 secs.usecs\n"
+  "read_bytes                9 samples [bytes] 4096 1048576 6475776\n"
+  "write_bytes               16 samples [bytes] 4096 1048576 16777216\n"
+  "get_info                  4 samples [reqs]\n"
+  "set_info_async            1 samples [reqs]\n"
+  "connect                   1 samples [reqs]\n"
+  "statfs                    212 samples [reqs]\n"
+  "create                    3 samples [reqs]\n"
+  "destroy                   7 samples [reqs]\n"
+  "setattr                   2 samples [reqs]\n"
+  "punch                     5 samples [reqs]\n"
+  "sync                      9 samples [reqs]\n"
+  "preprw                    25 samples [reqs]\n"
+  "commitrw                  25 samples [reqs]\n"
+  "ping                      1224 samples [reqs]\n";
+
+static int sscanf_read(const char *path, long *wr_out, long *rd_out, long *reqs_out)
+{
+  FILE* stats_file = fopen(path, "r");
+  if (stats_file == NULL) {
+    ERROR("cannot open %s: %m\n", path);
+    return -1;
+  }
+
+  char *line = NULL;
+  size_t line_size = 0;
+
+  /* Skip first line with its busted snapshot_time. */
+  getline(&line, &line_size, stats_file);
+
+  long wr = 0, rd = 0, reqs = 0;
+
+  while (getline(&line, &line_size, stats_file) >= 0) {
+    char ctr_name[80];
+    long ctr_samples, ctr_sum = 0;
+
+    if (sscanf(line, "%79s %ld samples [%*[^]]] %*d %*d %ld",
+               ctr_name, &ctr_samples, &ctr_sum) < 2) {
+      ERROR("invalid line \"%s\"\n", chop(line, '\n'));
+      continue;
+    }
+
+    if (strcmp(ctr_name, "write_bytes") == 0) {
+      wr = ctr_sum;
+    } else if (strcmp(ctr_name, "read_bytes") == 0) {
+      rd = ctr_sum;
+    } else if (strcmp(ctr_name, "ping") != 0) { /* Ignore pings. */
+      reqs += ctr_samples;
+    }
+  }
+  free(line);
+  fclose(stats_file);
+
+  *wr_out = wr;
+  *rd_out = rd;
+  *reqs_out = reqs;
+  return 0;
+}
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+  long i, nr_iter = argc > 1 ? atol(argv[1]) : 100000;
+  char path[] = "/tmp/lltop-stats-bench.XXXXXX";
+  struct stats_buf sb;
+  long wr[2], rd[2], reqs[2];
+  double t0, t1, t2;
+
+  int fd = mkstemp(path);
+  if (fd < 0)
+    FATAL("cannot create `%s': %m\n", path);
+
+  if (write(fd, stats_text, sizeof(stats_text) - 1) != sizeof(stats_text) - 1)
+    FATAL("cannot write `%s': %m\n", path);
+  close(fd);
+
+  if (stats_buf_init(&sb, STATS_BUF_SIZE) < 0)
+    FATAL("cannot allocate stats buffer: %m\n");
+
+  t0 = now();
+  for (i = 0; i < nr_iter; i++)
+    sscanf_read(path, &wr[0], &rd[0], &reqs[0]);
+
+  t1 = now();
+  for (i = 0; i < nr_iter; i++)
+    stats_read_at(&sb, AT_FDCWD, path, &wr[1], &rd[1], &reqs[1]);
+
+  t2 = now();
+  unlink(path);
+
+  printf("sscanf  %8.3f us/file  wr %ld rd %ld reqs %ld\n",
+         1e6 * (t1 - t0) / nr_iter, wr[0], rd[0], reqs[0]);
+  printf("stats   %8.3f us/file  wr %ld rd %ld reqs %ld\n",
+         1e6 * (t2 - t1) / nr_iter, wr[1], rd[1], reqs[1]);
+
+  if (wr[0] != wr[1] || rd[0] != rd[1] || reqs[0] != reqs[1])
+    FATAL("results differ\n");
+
+  stats_buf_destroy(&sb);
+
+  return 0;
+}
@@ -0,0 +1,354 @@
+/* lltop stats.c
+ * Copyright 2010 by John L. Hammond <jhammond@tacc.utexas.edu>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "lltop.h"
+#include "stats.h"
+
+/* A per-export stats file looks like this:
+
+   snapshot_time             1289410216.487593 secs.usecs
+   read_bytes                9 samples [bytes] 4096 1048576 6475776
+   write_bytes               16 samples [bytes] 4096 1048576 16777216
+   get_info                  4 samples [reqs]
+   ping                      1224 samples [reqs]
+   ...
+
+   The old parser did sscanf(line, "%79s %ld samples [%*[^]]] %*d %*d %ld")
+   on each line after the first.  The functions below accept exactly
+   the same inputs without copying, allocating, or calling into stdio. */
+
+#define CTR_NAME_MAX 79
+
+enum {
+  CTR_OTHER,
+  CTR_WRITE_BYTES,
+  CTR_READ_BYTES,
+  CTR_PING,
+};
+
+int stats_buf_init(struct stats_buf *sb, size_t size)
+{
+  sb->sb_buf = malloc(size);
+  if (sb->sb_buf == NULL)
+    return -1;
+
+  sb->sb_size = size;
+  return 0;
+}
+
+void stats_buf_destroy(struct stats_buf *sb)
+{
+  free(sb->sb_buf);
+  sb->sb_buf = NULL;
+  sb->sb_size = 0;
+}
+
+ssize_t stats_buf_pread(struct stats_buf *sb, int fd)
+{
+  ssize_t nr;
+
+  /* Proc files are generated on each read, so if we fill the buffer
+     we cannot just read the rest: grow and read again from the
+     start.  A short read means we have the whole file. */
+  while (1) {
+    nr = pread(fd, sb->sb_buf, sb->sb_size - 1, 0);
+    if (nr < 0)
+      return -1;
+
+    if (nr < sb->sb_size - 1)
+      break;
+
+    char *buf = realloc(sb->sb_buf, 2 * sb->sb_size);
+    if (buf == NULL)
+      return -1;
+
+    sb->sb_buf = buf;
+    sb->sb_size *= 2;
+  }
+
+  sb->sb_buf[nr] = 0;
+  return nr;
+}
+
+static inline int is_space(int c)
+{
+  return c == ' ' || c == '\t' || c == '\v' || c == '\f' || c == '\r';
+}
+
+static inline char *skip_space(char *p, char *end)
+{
+  while (p < end && is_space(*p))
+    p++;
+  return p;
+}
+
+/* Like %ld: skip leading space, optional sign, at least one digit. */
+static inline char *parse_long(char *p, char *end, long *val)
+{
+  int neg = 0;
+  long v = 0;
+  char *digits;
+
+  p = skip_space(p, end);
+  if (p < end && (*p == '-' || *p == '+'))
+    neg = *p++ == '-';
+
+  digits = p;
+  while (p < end && '0' <= *p && *p <= '9')
+    v = 10 * v + (*p++ - '0');
+
+  if (p == digits)
+    return NULL;
+
+  *val = neg ? -v : v;
+  return p;
+}
+
+static inline int ctr_type(const char *name, size_t len)
+{
+  /* Dispatch on length first so that we touch at most one name. */
+  switch (len) {
+  case 4:
+    return memcmp(name, "ping", 4) == 0 ? CTR_PING : CTR_OTHER;
+  case 10:
+    return memcmp(name, "read_bytes", 10) == 0 ? CTR_READ_BYTES : CTR_OTHER;
+  case 11:
+    return memcmp(name, "write_bytes", 11) == 0 ? CTR_WRITE_BYTES : CTR_OTHER;
+  default:
+    return CTR_OTHER;
+  }
+}
+
+/* Parse one line (without its newline), returning -1 if it's invalid. */
+static int parse_line(char *p, char *end, int *type, long *samples, long *sum)
+{
+  char *name;
+  long min, max;
+
+  p = skip_space(p, end);
+  name = p;
+  while (p < end && !is_space(*p))
+    p++;
+
+  if (p == name)
+    return -1;
+
+  /* Like %79s, a longer name is split and the rest is parsed as the
+     sample count. */
+  if (p - name > CTR_NAME_MAX)
+    p = name + CTR_NAME_MAX;
+
+  *type = ctr_type(name, p - name);
+
+  p = parse_long(p, end, samples);
+  if (p == NULL)
+    return -1;
+
+  /* Everything after the sample count is optional. */
+  *sum = 0;
+  p = skip_space(p, end);
+  if (end - p < 7 || memcmp(p, "samples", 7) != 0)
+    return 0;
+
+  p = skip_space(p + 7, end);
+  if (p == end || *p++ != '[')
+    return 0;
+
+  char *units = p;
+  while (p < end && *p != ']')
+    p++;
+
+  if (p == units || p == end)
+    return 0;
+  p++;
+
+  if ((p = parse_long(p, end, &min)) == NULL ||
+      (p = parse_long(p, end, &max)) == NULL ||
+      parse_long(p, end, sum) == NULL)
+    *sum = 0;
+
+  return 0;
+}
+
+int stats_parse(char *buf, size_t len, long *wr, long *rd, long *reqs)
+{
+  char *pos = buf, *end = buf + len, *eol;
+
+  *wr = *rd = *reqs = 0;
+
+  /* Skip first line with its busted snapshot_time. */
+  eol = memchr(pos, '\n', end - pos);
+  if (eol == NULL)
+    return 0;
+  pos = eol + 1;
+
+  for (; pos < end; pos = eol + 1) {
+    int type;
+    long samples, sum;
+
+    eol = memchr(pos, '\n', end - pos);
+    if (eol == NULL)
+      eol = end;
+
+    if (parse_line(pos, eol, &type, &samples, &sum) < 0) {
+      *eol = 0;
+      ERROR("invalid line \"%s\"\n", pos);
+      continue;
+    }
+
+    switch (type) {
+    case CTR_WRITE_BYTES:
+      *wr = sum;
+      break;
+    case CTR_READ_BYTES:
+      *rd = sum;
+      break;
+    case CTR_PING: /* Ignore pings. */
+      break;
+    default:
+      *reqs += samples;
+      break;
+    }
+  }
+
+  return 0;
+}
+
+/* A job_stats file looks like this:
+
+   job_stats:
+   - job_id:          dd.0
+     snapshot_time:   1352085000
+     read_bytes:      { samples:           0, unit: bytes, min:       0, max:       0, sum:               0 }
+     write_bytes:     { samples:           1, unit: bytes, min:    4096, max:    4096, sum:            4096 }
+     getattr:         { samples:           0, unit:  reqs }
+     ...
+   - job_id:          ...
+
+   Newer Lustres add more keys to each job and more fields to each
+   counter, and quote some job ids.  We only look for samples and sum
+   inside the braces and ignore lines without braces. */
+
+static inline char *find_field(char *p, char *end, const char *name, size_t len)
+{
+  char *f = memmem(p, end - p, name, len);
+  return f != NULL ? f + len : NULL;
+}
+
+int stats_parse_jobs(char *buf, size_t len,
+                     void (*job_cb)(void *, const char *, long, long, long),
+                     void *arg)
+{
+  char *pos = buf, *end = buf + len, *eol;
+  const char *job = NULL;
+  long wr = 0, rd = 0, reqs = 0;
+
+  for (; pos < end; pos = eol + 1) {
+    eol = memchr(pos, '\n', end - pos);
+    if (eol == NULL)
+      eol = end;
+
+    char *p = skip_space(pos, eol);
+
+    if (eol - p > 8 && memcmp(p, "- job_id:", 9) == 0) {
+      if (job != NULL)
+        (*job_cb)(arg, job, wr, rd, reqs);
+
+      char *q = eol;
+      p = skip_space(p + 9, eol);
+      while (q > p && is_space(q[-1]))
+        q--;
+
+      if (q - p >= 2 && *p == '"' && q[-1] == '"') {
+        p++;
+        q--;
+      }
+
+      *q = 0;
+      job = p;
+      wr = rd = reqs = 0;
+      continue;
+    }
+
+    if (job == NULL)
+      continue;
+
+    char *colon = memchr(p, ':', eol - p);
+    char *brace = memchr(p, '{', eol - p);
+    if (colon == NULL || brace == NULL || brace < colon)
+      continue;
+
+    long samples = 0, sum = 0;
+    char *f = find_field(brace, eol, "samples:", 8);
+    if (f == NULL || parse_long(f, eol, &samples) == NULL) {
+      *eol = 0;
+      ERROR("invalid line \"%s\"\n", pos);
+      continue;
+    }
+
+    f = find_field(brace, eol, "sum:", 4);
+    if (f == NULL || parse_long(f, eol, &sum) == NULL)
+      sum = 0;
+
+    switch (ctr_type(p, colon - p)) {
+    case CTR_WRITE_BYTES:
+      wr = sum;
+      break;
+    case CTR_READ_BYTES:
+      rd = sum;
+      break;
+    case CTR_PING:
+      break;
+    default:
+      reqs += samples;
+      break;
+    }
+  }
+
+  if (job != NULL)
+    (*job_cb)(arg, job, wr, rd, reqs);
+
+  return 0;
+}
+
+int stats_read_at(struct stats_buf *sb, int dir_fd, const char *path,
+                  long *wr, long *rd, long *reqs)
+{
+  int fd = openat(dir_fd, path, O_RDONLY);
+  if (fd < 0) {
+    ERROR("cannot open %s: %m\n", path);
+    return -1;
+  }
+
+  ssize_t len = stats_buf_pread(sb, fd);
+  if (len < 0) {
+    ERROR("cannot read %s: %m\n", path);
+    close(fd);
+    return -1;
+  }
+  close(fd);
+
+  return stats_parse(sb->sb_buf, len, wr, rd, reqs);
+}
@@ -0,0 +1,41 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Reusable buffer for reading Lustre stats files.  The buffer grows
+   as needed and is never shrunk, so after the first few files
+   stats_buf_pread() does no allocation. */
+struct stats_buf {
+  char *sb_buf;
+  size_t sb_size;
+};
+
+#define STATS_BUF_SIZE 4096
+
+int stats_buf_init(struct stats_buf *sb, size_t size);
+void stats_buf_destroy(struct stats_buf *sb);
+
+/* Read all of fd (from offset 0) into sb, NUL terminate, and return
+   the length read, or -1 on error. */
+ssize_t stats_buf_pread(struct stats_buf *sb, int fd);
+
+/* Parse the contents of a per-export stats file in place.  Sets *wr
+   and *rd to the sums of write_bytes and read_bytes, and *reqs to
+   the total number of samples of all other counters except ping. */
+int stats_parse(char *buf, size_t len, long *wr, long *rd, long *reqs);
+
+/* Parse the contents of a target's job_stats file in place, calling
+   job_cb(arg, job, wr, rd, reqs) once for each job, with counters
+   computed as for stats_parse(). */
+int stats_parse_jobs(char *buf, size_t len,
+                     void (*job_cb)(void *arg, const char *job,
+                                    long wr, long rd, long reqs),
+                     void *arg);
+
+/* Open path relative to dir_fd (or AT_FDCWD), read it into sb, and
+   parse it as above. */
+int stats_read_at(struct stats_buf *sb, int dir_fd, const char *path,
+                  long *wr, long *rd, long *reqs);
+
+#endif
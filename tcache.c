@@ -0,0 +1,311 @@
+/* lltop tcache.c
+ * Copyright 2010 by John L. Hammond <jhammond@tacc.utexas.edu>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "lltop.h"
+#include "tcache.h"
+
+/* How many times to wait for someone else's table before giving up
+ * and making our own. */
+#define TCACHE_TRIES 3
+
+static uint64_t key_hash(const char *key, size_t key_len)
+{
+  /* 64 bit FNV-1a. */
+  uint64_t h = 14695981039346656037ULL;
+  size_t i;
+
+  for (i = 0; i < key_len; i++) {
+    h ^= (unsigned char) key[i];
+    h *= 1099511628211ULL;
+  }
+
+  return h;
+}
+
+int tcache_open(struct tcache *tc, const char *dir, const char *key,
+                size_t key_len, int max_age)
+{
+  unsigned long long h = key_hash(key, key_len);
+
+  memset(tc, 0, sizeof(*tc));
+  tc->tc_lock_fd = -1;
+  tc->tc_max_age = max_age;
+  tc->tc_start = time(NULL);
+
+  /* Everyone in dir's group shares, whatever their umask, as with
+   * lltop-serv --share.  The setgid bit gives new files dir's group. */
+  if (mkdir(dir, 0775) == 0) {
+    if (chmod(dir, 02775) < 0) {
+      ERROR("cannot chmod `%s': %m\n", dir);
+      return -1;
+    }
+  } else if (errno != EEXIST) {
+    ERROR("cannot create `%s': %m\n", dir);
+    return -1;
+  }
+
+  /* Those who can't write dir only use tables, they never make them. */
+  tc->tc_writable = access(dir, W_OK) == 0;
+
+  tc->tc_key = alloc(key_len);
+  memcpy(tc->tc_key, key, key_len);
+  tc->tc_key_len = key_len;
+
+  if (asprintf(&tc->tc_path, "%s/%016llx.table", dir, h) < 0 ||
+      asprintf(&tc->tc_lock_path, "%s/%016llx.lock", dir, h) < 0)
+    FATAL("out of memory\n");
+
+  return 0;
+}
+
+void tcache_close(struct tcache *tc)
+{
+  if (tc->tc_lock_fd >= 0)
+    close(tc->tc_lock_fd);
+  tc->tc_lock_fd = -1;
+  free(tc->tc_key);
+  free(tc->tc_path);
+  free(tc->tc_lock_path);
+  tc->tc_key = tc->tc_path = tc->tc_lock_path = NULL;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+  char *p = buf;
+
+  while (len > 0) {
+    ssize_t nr = read(fd, p, len);
+    if (nr < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (nr == 0)
+      return -1;
+    p += nr;
+    len -= nr;
+  }
+
+  return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+  const char *p = buf;
+
+  while (len > 0) {
+    ssize_t nr = write(fd, p, len);
+    if (nr < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += nr;
+    len -= nr;
+  }
+
+  return 0;
+}
+
+static int tcache_read(struct tcache *tc, char **buf, size_t *len)
+{
+  /* Return 1 and the table if there is a fresh one for our key. */
+  struct tcache_header hdr;
+  char *key = NULL, *table = NULL;
+  int fd, rc = 0;
+
+  fd = open(tc->tc_path, O_RDONLY|O_CLOEXEC);
+  if (fd < 0) {
+    if (errno != ENOENT)
+      ERROR("cannot open `%s': %m\n", tc->tc_path);
+    return 0;
+  }
+
+  if (read_all(fd, &hdr, sizeof(hdr)) < 0 ||
+      memcmp(hdr.h_magic, TCACHE_MAGIC, sizeof(hdr.h_magic)) != 0 ||
+      hdr.h_version != TCACHE_VERSION ||
+      hdr.h_key_len != tc->tc_key_len)
+    goto out;
+
+  if (hdr.h_time < tc->tc_start &&
+      hdr.h_time + tc->tc_max_age < time(NULL)) {
+    TRACE("table `%s' is stale\n", tc->tc_path);
+    goto out;
+  }
+
+  key = alloc(hdr.h_key_len);
+  table = alloc(hdr.h_len + 1);
+  if (read_all(fd, key, hdr.h_key_len) < 0 ||
+      memcmp(key, tc->tc_key, hdr.h_key_len) != 0 ||
+      read_all(fd, table, hdr.h_len) < 0)
+    goto out;
+
+  *buf = table;
+  *len = hdr.h_len;
+  table = NULL;
+  rc = 1;
+
+ out:
+  close(fd);
+  free(key);
+  free(table);
+
+  return rc;
+}
+
+static int tcache_open_lock(struct tcache *tc)
+{
+  if (tc->tc_writable) {
+    tc->tc_lock_fd = open(tc->tc_lock_path, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, 0664);
+    if (tc->tc_lock_fd >= 0) {
+      if (fchmod(tc->tc_lock_fd, 0664) < 0) {
+        ERROR("cannot chmod `%s': %m\n", tc->tc_lock_path);
+        return -1;
+      }
+      return 0;
+    }
+    if (errno != EEXIST) {
+      ERROR("cannot create `%s': %m\n", tc->tc_lock_path);
+      return -1;
+    }
+  }
+
+  /* flock() doesn't care how the file is open. */
+  tc->tc_lock_fd = open(tc->tc_lock_path, O_RDONLY|O_CLOEXEC);
+  if (tc->tc_lock_fd < 0 && (tc->tc_writable || errno != ENOENT))
+    ERROR("cannot open `%s': %m\n", tc->tc_lock_path);
+
+  return tc->tc_lock_fd < 0 ? -1 : 0;
+}
+
+int tcache_get(struct tcache *tc, char **buf, size_t *len)
+{
+  int i;
+
+  if (tc->tc_lock_fd < 0 && tcache_open_lock(tc) < 0) {
+    /* Without a lock file, there may still be a table. */
+    return tcache_read(tc, buf, len) ? 1 : -1;
+  }
+
+  for (i = 0; i < TCACHE_TRIES; i++) {
+    if (tcache_read(tc, buf, len))
+      return 1;
+
+    /* We have waited once for the table we can't make ourselves. */
+    if (!tc->tc_writable && i > 0)
+      return -1;
+
+    if (tc->tc_writable && flock(tc->tc_lock_fd, LOCK_EX|LOCK_NB) == 0) {
+      /* The last maker may have finished since we looked. */
+      if (tcache_read(tc, buf, len)) {
+        flock(tc->tc_lock_fd, LOCK_UN);
+        return 1;
+      }
+      return 0;
+    }
+
+    if (tc->tc_writable && errno != EWOULDBLOCK) {
+      ERROR("cannot lock `%s': %m\n", tc->tc_lock_path);
+      return -1;
+    }
+
+    /* Someone else is making the table, wait for them. */
+    TRACE("waiting on `%s'\n", tc->tc_lock_path);
+    while (flock(tc->tc_lock_fd, LOCK_SH) < 0) {
+      if (errno != EINTR) {
+        ERROR("cannot lock `%s': %m\n", tc->tc_lock_path);
+        return -1;
+      }
+    }
+    flock(tc->tc_lock_fd, LOCK_UN);
+  }
+
+  return -1;
+}
+
+int tcache_put(struct tcache *tc, const char *buf, size_t len)
+{
+  struct tcache_header hdr;
+  char *tmp_path = NULL;
+  int fd = -1, rc = -1;
+
+  if (asprintf(&tmp_path, "%s.%d.tmp", tc->tc_path, (int) getpid()) < 0) {
+    tmp_path = NULL;
+    goto out;
+  }
+
+  fd = open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0664);
+  if (fd < 0) {
+    ERROR("cannot create `%s': %m\n", tmp_path);
+    goto out;
+  }
+
+  if (fchmod(fd, 0664) < 0) {
+    ERROR("cannot chmod `%s': %m\n", tmp_path);
+    goto out;
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.h_magic, TCACHE_MAGIC, sizeof(hdr.h_magic));
+  hdr.h_version = TCACHE_VERSION;
+  hdr.h_time = time(NULL);
+  hdr.h_key_len = tc->tc_key_len;
+  hdr.h_len = len;
+
+  if (write_all(fd, &hdr, sizeof(hdr)) < 0 ||
+      write_all(fd, tc->tc_key, tc->tc_key_len) < 0 ||
+      write_all(fd, buf, len) < 0) {
+    ERROR("cannot write `%s': %m\n", tmp_path);
+    goto out;
+  }
+
+  if (close(fd) < 0) {
+    fd = -1;
+    ERROR("cannot write `%s': %m\n", tmp_path);
+    goto out;
+  }
+  fd = -1;
+
+  if (rename(tmp_path, tc->tc_path) < 0) {
+    ERROR("cannot rename `%s' to `%s': %m\n", tmp_path, tc->tc_path);
+    goto out;
+  }
+
+  rc = 0;
+
+ out:
+  if (fd >= 0)
+    close(fd);
+  if (rc < 0 && tmp_path != NULL)
+    unlink(tmp_path);
+  free(tmp_path);
+
+  /* Waiters wake up and read the table now. */
+  flock(tc->tc_lock_fd, LOCK_UN);
+
+  return rc;
+}
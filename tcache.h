@@ -0,0 +1,55 @@
+#ifndef _TCACHE_H_
+#define _TCACHE_H_
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Table cache (lltop --share).  Each finished table is kept in
+   DIR/KEY.table, where KEY is a hash of the options and servers that
+   produced it.  Whoever is making a table for KEY holds an exclusive
+   flock() on DIR/KEY.lock, so a second lltop with the same KEY can
+   wait for that table instead of asking the servers itself.  Tables
+   are written to a temporary file and rename()d into place.  DIR is
+   made setgid and group writable, and the files group writable, so
+   that everyone in DIR's group can share. */
+
+#define TCACHE_MAGIC "LLTT"
+#define TCACHE_VERSION 1
+
+struct tcache_header {
+  char h_magic[4];
+  uint32_t h_version;
+  int64_t h_time; /* Wall clock seconds when the table was made. */
+  uint32_t h_key_len;
+  uint32_t h_len;
+};
+
+struct tcache {
+  char *tc_key; /* The whole key, checked against the table file. */
+  size_t tc_key_len;
+  char *tc_path, *tc_lock_path;
+  int tc_lock_fd;
+  int tc_writable; /* We can make tables in dir. */
+  int tc_max_age;
+  time_t tc_start;
+};
+
+/* Set up the cache for key in dir, creating dir if needed.  Tables
+   up to max_age seconds old are fresh, and so is any table finished
+   after now. */
+int tcache_open(struct tcache *tc, const char *dir, const char *key,
+                size_t key_len, int max_age);
+void tcache_close(struct tcache *tc);
+
+/* Get a fresh table for our key, waiting for one that is being made.
+   Returns 1 and sets *buf (malloc()ed) and *len if there is one.
+   Returns 0 if there isn't, and we now hold the lock and should make
+   the table and tcache_put() it.  Returns -1 if we should make our
+   own table without the cache, as we always do if we can't write
+   dir. */
+int tcache_get(struct tcache *tc, char **buf, size_t *len);
+
+/* Save our table and drop the lock. */
+int tcache_put(struct tcache *tc, const char *buf, size_t len);
+
+#endif
@@ -0,0 +1,123 @@
+/* lltop tok-bench.c
+ * Copyright 2010 by John L. Hammond <jhammond@tacc.utexas.edu>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA.
+ */
+/* Microbenchmark: time the old memchr/sscanf line parser against
+   tok_split()/tok_long() on synthetic lltop-serv output.
+   Usage: tok-bench [LINES] */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "lltop.h"
+#include "tok.h"
+
+struct sums {
+  long s_lines, s_name, s_wr, s_rd, s_reqs;
+};
+
+static void sscanf_parse(char *buf, size_t len, struct sums *s)
+{
+  char *pos = buf, *end = buf + len, *eol;
+  char addr[1025];
+  long wr, rd, reqs;
+
+  while ((eol = memchr(pos, '\n', end - pos)) != NULL) {
+    *eol = 0;
+    if (sscanf(pos, "%1024s %ld %ld %ld", addr, &wr, &rd, &reqs) == 4) {
+      s->s_lines++;
+      s->s_name += strlen(addr);
+      s->s_wr += wr;
+      s->s_rd += rd;
+      s->s_reqs += reqs;
+    }
+    pos = eol + 1;
+  }
+}
+
+static void tok_parse(char *buf, size_t len, struct sums *s)
+{
+  char *pos = buf, *end = buf + len, *eol;
+  char *field[4];
+  long wr, rd, reqs;
+
+  while ((eol = tok_line(pos, end)) != NULL) {
+    *eol = 0;
+    if (tok_split(pos, eol - pos, field, 4) == 4 &&
+        tok_long(field[1], &wr) == 0 &&
+        tok_long(field[2], &rd) == 0 &&
+        tok_long(field[3], &reqs) == 0) {
+      s->s_lines++;
+      s->s_name += strlen(field[0]);
+      s->s_wr += wr;
+      s->s_rd += rd;
+      s->s_reqs += reqs;
+    }
+    pos = eol + 1;
+  }
+}
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+  long i, nr_lines = argc > 1 ? atol(argv[1]) : 1000000;
+  size_t len = 0, size = nr_lines * 64 + 1;
+  char *text = malloc(size), *buf = malloc(size);
+  struct sums s[2];
+  double t0, t1, t2, t3;
+
+  if (text == NULL || buf == NULL)
+    FATAL("cannot allocate buffers: %m\n");
+
+  srandom(1);
+  for (i = 0; i < nr_lines; i++)
+    len += snprintf(text + len, size - len, "10.%ld.%ld.%ld@o2ib %ld %ld %ld\n",
+                    (i >> 16) & 255, (i >> 8) & 255, i & 255,
+                    random() % (1L << 30), random() % (1L << 20), random() % 10000);
+
+  memset(s, 0, sizeof(s));
+
+  memcpy(buf, text, len);
+  t0 = now();
+  sscanf_parse(buf, len, &s[0]);
+  t1 = now();
+
+  memcpy(buf, text, len);
+  t2 = now();
+  tok_parse(buf, len, &s[1]);
+  t3 = now();
+
+  printf("sscanf  %8.3f ns/line  lines %ld wr %ld rd %ld reqs %ld\n",
+         1e9 * (t1 - t0) / nr_lines, s[0].s_lines, s[0].s_wr, s[0].s_rd, s[0].s_reqs);
+  printf("tok     %8.3f ns/line  lines %ld wr %ld rd %ld reqs %ld\n",
+         1e9 * (t3 - t2) / nr_lines, s[1].s_lines, s[1].s_wr, s[1].s_rd, s[1].s_reqs);
+
+  if (memcmp(&s[0], &s[1], sizeof(s[0])) != 0)
+    FATAL("results differ\n");
+
+  free(text);
+  free(buf);
+
+  return 0;
+}
@@ -0,0 +1,130 @@
+/* lltop tok.c
+ * Copyright 2010 by John L. Hammond <jhammond@tacc.utexas.edu>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA.
+ */
+#include <limits.h>
+#include <stdint.h>
+#include "tok.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define TOK_CHUNK 32
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define TOK_CHUNK 16
+#else
+#define TOK_CHUNK 8
+#endif
+#define TOK_MASK ((uint32_t) -1 >> (32 - TOK_CHUNK))
+
+static inline uint32_t ws_mask_tail(const char *p, size_t len)
+{
+  /* Bit i is set if p[i] is whitespace, or if i >= len. */
+  uint32_t mask = 0;
+  size_t i;
+
+  for (i = 0; i < TOK_CHUNK; i++)
+    if (i >= len || (unsigned char) p[i] <= ' ')
+      mask |= (uint32_t) 1 << i;
+
+  return mask;
+}
+
+static inline uint32_t ws_mask(const char *p)
+{
+  /* Bit i is set if p[i] is whitespace, for a whole chunk.  x <= ' '
+   * is max(x, ' ') == ' ', since SSE2 has no unsigned compare. */
+#if defined(__AVX2__)
+  __m256i x = _mm256_loadu_si256((const __m256i *) p);
+  __m256i sp = _mm256_set1_epi8(' ');
+  return _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(x, sp), sp));
+#elif defined(__SSE2__)
+  __m128i x = _mm_loadu_si128((const __m128i *) p);
+  __m128i sp = _mm_set1_epi8(' ');
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(x, sp), sp));
+#else
+  return ws_mask_tail(p, TOK_CHUNK);
+#endif
+}
+
+int tok_split(char *line, size_t len, char **field_vec, int nr_fields)
+{
+  /* For each chunk, the fields that start in it are the non
+   * whitespace bytes preceded by whitespace, and the fields that end
+   * in it are the whitespace bytes preceded by non whitespace.  We
+   * visit those bytes in order with ctz.  prev_ws carries whether the
+   * last byte of the previous chunk was whitespace. */
+  uint32_t prev_ws = 1;
+  size_t off;
+  int nr = 0;
+
+  if (nr_fields <= 0)
+    return 0;
+
+  for (off = 0; off < len; off += TOK_CHUNK) {
+    char *p = line + off;
+    uint32_t ws, shifted, edges;
+
+    ws = off + TOK_CHUNK <= len ? ws_mask(p) : ws_mask_tail(p, len - off);
+    shifted = (ws << 1) | prev_ws;
+    edges = (ws ^ shifted) & TOK_MASK; /* Starts where !ws, ends where ws. */
+    prev_ws = ws >> (TOK_CHUNK - 1);
+
+    while (edges != 0) {
+      int i = __builtin_ctz(edges);
+      edges &= edges - 1;
+
+      if (!(ws & ((uint32_t) 1 << i))) {
+        field_vec[nr] = p + i;
+      } else {
+        p[i] = 0;
+        if (++nr == nr_fields)
+          return nr;
+      }
+    }
+  }
+
+  /* A field that runs to the end of a whole last chunk. */
+  if (!prev_ws) {
+    line[len] = 0;
+    nr++;
+  }
+
+  return nr;
+}
+
+int tok_long(const char *s, long *val)
+{
+  unsigned long max = LONG_MAX, v = 0;
+  int neg = 0;
+
+  if (*s == '-' || *s == '+')
+    neg = *s++ == '-';
+
+  if (*s == 0)
+    return -1;
+
+  for (; *s != 0; s++) {
+    unsigned int d = (unsigned char) *s - '0';
+    if (d > 9 || v > (max - d) / 10)
+      return -1;
+    v = 10 * v + d;
+  }
+
+  *val = neg ? -(long) v : (long) v;
+  return 0;
+}
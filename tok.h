@@ -0,0 +1,29 @@
+#ifndef _TOK_H_
+#define _TOK_H_
+#include <stddef.h>
+#include <string.h>
+
+/* Tokenizer for lltop-serv style records, "<name> <wr> <rd> <reqs>".
+   Fields are separated by runs of whitespace, which here means any
+   byte <= ' '.  tok_split() classifies 32 (AVX2) or 16 (SSE2) bytes at
+   a time when it can, and one at a time otherwise. */
+
+/* Return the next newline in [pos, end), or NULL.  memchr() is
+   already vectorized in glibc, so this is just a name for it. */
+static inline char *tok_line(char *pos, char *end)
+{
+  return memchr(pos, '\n', end - pos);
+}
+
+/* Split the len bytes of line in place, NUL terminating each field
+   and storing a pointer to it in field_vec.  line[len] must be
+   writable.  Stops after nr_fields fields and returns the number
+   stored. */
+int tok_split(char *line, size_t len, char **field_vec, int nr_fields);
+
+/* Decode the decimal integer s (with an optional sign), which must be
+   all of s, into *val.  Returns 0 on success, -1 on junk or
+   overflow. */
+int tok_long(const char *s, long *val);
+
+#endif
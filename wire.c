@@ -0,0 +1,273 @@
+/* lltop wire.c
+ * Copyright 2010 by John L. Hammond <jhammond@tacc.utexas.edu>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "lltop.h"
+#include "wire.h"
+
+/* Longest possible record: tag, length, name, and three counters. */
+#define WIRE_REC_MAX (1 + 2 + MAXNAME + 3 * 10)
+
+static uint32_t adler32(const unsigned char *p, size_t len)
+{
+  uint32_t a = 1, b = 0;
+
+  while (len > 0) {
+    /* 5552 is the most we can do before reducing mod 65521. */
+    size_t n = len < 5552 ? len : 5552;
+    len -= n;
+    while (n-- > 0) {
+      a += *p++;
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+  }
+
+  return (b << 16) | a;
+}
+
+static inline unsigned char *put_be32(unsigned char *p, uint32_t v)
+{
+  *p++ = v >> 24;
+  *p++ = v >> 16;
+  *p++ = v >> 8;
+  *p++ = v;
+  return p;
+}
+
+static inline uint32_t get_be32(const unsigned char *p)
+{
+  return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+    ((uint32_t) p[2] << 8) | p[3];
+}
+
+static inline unsigned char *put_varint(unsigned char *p, uint64_t v)
+{
+  while (v >= 0x80) {
+    *p++ = v | 0x80;
+    v >>= 7;
+  }
+  *p++ = v;
+  return p;
+}
+
+static inline unsigned char *put_svarint(unsigned char *p, long v)
+{
+  /* Zigzag, so small negative values stay small. */
+  return put_varint(p, ((uint64_t) v << 1) ^ (uint64_t) (v >> 63));
+}
+
+static inline const unsigned char *
+get_varint(const unsigned char *p, const unsigned char *end, uint64_t *v)
+{
+  int shift;
+
+  *v = 0;
+  for (shift = 0; p < end && shift < 64; shift += 7) {
+    *v |= (uint64_t) (*p & 0x7f) << shift;
+    if ((*p++ & 0x80) == 0)
+      return p;
+  }
+
+  return NULL;
+}
+
+static inline const unsigned char *
+get_svarint(const unsigned char *p, const unsigned char *end, long *v)
+{
+  uint64_t u;
+
+  p = get_varint(p, end, &u);
+  if (p != NULL)
+    *v = (long) (u >> 1) ^ -(long) (u & 1);
+  return p;
+}
+
+void wire_buf_init(struct wire_buf *wb, int fd)
+{
+  wb->wb_fd = fd;
+  wb->wb_len = 0;
+}
+
+int wire_buf_put(struct wire_buf *wb, const char *name, int try_nid,
+                 long wr, long rd, long reqs)
+{
+  unsigned char rec[WIRE_REC_MAX], *p = rec;
+  size_t name_len = strlen(name);
+  nid_t nid;
+
+  if (try_nid && nid_parse(name, &nid) == 0) {
+    *p++ = WIRE_REC_NID;
+    p = put_varint(p, NID_NET(nid));
+    p = put_be32(p, NID_ADDR(nid));
+  } else {
+    if (name_len > MAXNAME) {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+    *p++ = WIRE_REC_NAME;
+    p = put_varint(p, name_len);
+    memcpy(p, name, name_len);
+    p += name_len;
+  }
+
+  p = put_svarint(p, wr);
+  p = put_svarint(p, rd);
+  p = put_svarint(p, reqs);
+
+  if (wb->wb_len + (p - rec) > WIRE_FRAME_MAX && wire_buf_flush(wb) < 0)
+    return -1;
+
+  memcpy(wb->wb_buf + WIRE_HEADER_SIZE + wb->wb_len, rec, p - rec);
+  wb->wb_len += p - rec;
+
+  return 0;
+}
+
+int wire_buf_flush(struct wire_buf *wb)
+{
+  unsigned char *p = wb->wb_buf;
+  size_t len, off = 0;
+
+  if (wb->wb_len == 0)
+    return 0;
+
+  memcpy(p, WIRE_MAGIC, 3);
+  p[3] = WIRE_VERSION;
+  put_be32(p + 4, wb->wb_len);
+  put_be32(p + WIRE_HEADER_SIZE + wb->wb_len,
+           adler32(p + WIRE_HEADER_SIZE, wb->wb_len));
+
+  len = WIRE_HEADER_SIZE + wb->wb_len + WIRE_TRAILER_SIZE;
+  while (off < len) {
+    ssize_t nr = write(wb->wb_fd, wb->wb_buf + off, len - off);
+    if (nr < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    off += nr;
+  }
+
+  wb->wb_len = 0;
+  return 0;
+}
+
+static int decode_payload(const unsigned char *p, const unsigned char *end,
+                          void (*rec_cb)(void *, struct wire_rec *), void *arg)
+{
+  struct wire_rec rec;
+  uint64_t v;
+
+  while (p < end) {
+    rec.r_type = *p++;
+    switch (rec.r_type) {
+    case WIRE_REC_NID:
+      if ((p = get_varint(p, end, &v)) == NULL || end - p < 4)
+        return -1;
+      rec.r_nid = MKNID(v, get_be32(p));
+      p += 4;
+      nid_format(rec.r_nid, rec.r_name, sizeof(rec.r_name));
+      break;
+    case WIRE_REC_NAME:
+      if ((p = get_varint(p, end, &v)) == NULL || v > MAXNAME || end - p < v)
+        return -1;
+      memcpy(rec.r_name, p, v);
+      rec.r_name[v] = 0;
+      p += v;
+      break;
+    default:
+      return -1;
+    }
+
+    if ((p = get_svarint(p, end, &rec.r_wr)) == NULL ||
+        (p = get_svarint(p, end, &rec.r_rd)) == NULL ||
+        (p = get_svarint(p, end, &rec.r_reqs)) == NULL)
+      return -1;
+
+    (*rec_cb)(arg, &rec);
+  }
+
+  return 0;
+}
+
+size_t wire_decode(const void *buf, size_t len,
+                   void (*rec_cb)(void *arg, struct wire_rec *rec),
+                   void *arg, size_t *nr_bad)
+{
+  const unsigned char *start = buf, *pos = start, *end = start + len;
+
+  while (end - pos >= WIRE_HEADER_SIZE) {
+    if (memcmp(pos, WIRE_MAGIC, 3) != 0 || pos[3] != WIRE_VERSION) {
+      /* Resynchronize on the next magic. */
+      const unsigned char *m = memchr(pos + 1, WIRE_MAGIC[0], end - pos - 1);
+      pos = m != NULL ? m : end;
+      (*nr_bad)++;
+      continue;
+    }
+
+    uint32_t frame_len = get_be32(pos + 4);
+    if (frame_len > WIRE_FRAME_MAX) {
+      pos++;
+      (*nr_bad)++;
+      continue;
+    }
+
+    if (end - pos < WIRE_HEADER_SIZE + frame_len + WIRE_TRAILER_SIZE)
+      break;
+
+    const unsigned char *payload = pos + WIRE_HEADER_SIZE;
+    if (adler32(payload, frame_len) != get_be32(payload + frame_len)) {
+      pos++;
+      (*nr_bad)++;
+      continue;
+    }
+
+    if (decode_payload(payload, payload + frame_len, rec_cb, arg) < 0)
+      (*nr_bad)++;
+
+    pos = payload + frame_len + WIRE_TRAILER_SIZE;
+  }
+
+  return pos - start;
+}
+
+void wire_decode_rest(const void *buf, size_t len,
+                      void (*rec_cb)(void *arg, struct wire_rec *rec),
+                      void *arg, size_t *nr_bad)
+{
+  const unsigned char *pos = buf, *end = pos + len;
+
+  while (pos < end) {
+    pos += wire_decode(pos, end - pos, rec_cb, arg, nr_bad);
+    if (pos == end)
+      break;
+
+    /* pos is a header whose frame runs past EOF. */
+    (*nr_bad)++;
+    pos = memmem(pos + 1, end - pos - 1, WIRE_MAGIC, 3);
+    if (pos == NULL)
+      break;
+  }
+}
@@ -0,0 +1,72 @@
+#ifndef _WIRE_H_
+#define _WIRE_H_
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "lltop.h"
+#include "nid.h"
+
+/* Binary lltop-serv output (--format=binary).  The stream is a
+   sequence of frames:
+
+     "LLT" WIRE_VERSION  4 bytes
+     length              4 bytes, big endian, at most WIRE_FRAME_MAX
+     payload             length bytes
+     checksum            4 bytes, big endian, Adler-32 of payload
+
+   and the payload is a sequence of records:
+
+     WIRE_REC_NID  net (varint), addr (4 bytes, big endian), wr, rd, reqs
+     WIRE_REC_NAME length (varint), name (length bytes), wr, rd, reqs
+
+   where the tag is one byte and the counters are zigzag varints.
+   Frames are kept under PIPE_BUF so that each is a single write(). */
+
+#define WIRE_MAGIC "LLT"
+#define WIRE_VERSION 1
+#define WIRE_HEADER_SIZE 8
+#define WIRE_TRAILER_SIZE 4
+#define WIRE_FRAME_MAX 4000
+
+#define WIRE_REC_NID 1
+#define WIRE_REC_NAME 2
+
+struct wire_rec {
+  int r_type;
+  nid_t r_nid; /* If r_type is WIRE_REC_NID. */
+  long r_wr, r_rd, r_reqs;
+  char r_name[MAXNAME + 1]; /* Formatted NID, or name. */
+};
+
+struct wire_buf {
+  int wb_fd;
+  size_t wb_len;
+  unsigned char wb_buf[WIRE_HEADER_SIZE + WIRE_FRAME_MAX + WIRE_TRAILER_SIZE];
+};
+
+void wire_buf_init(struct wire_buf *wb, int fd);
+
+/* Append a record for name (as a NID if try_nid and it parses). */
+int wire_buf_put(struct wire_buf *wb, const char *name, int try_nid,
+                 long wr, long rd, long reqs);
+
+/* Write out any buffered records as a frame. */
+int wire_buf_flush(struct wire_buf *wb);
+
+/* Decode the complete frames in buf, calling rec_cb(arg, rec) for each
+   record.  Returns the number of bytes consumed; the caller should
+   keep the rest and call again when more arrives.  Garbage and frames
+   with bad checksums are skipped and counted in *nr_bad. */
+size_t wire_decode(const void *buf, size_t len,
+                   void (*rec_cb)(void *arg, struct wire_rec *rec),
+                   void *arg, size_t *nr_bad);
+
+/* Decode what is left of a stream at EOF, where a frame that is still
+   incomplete was cut short.  Such a frame and any other garbage are
+   skipped (counted in *nr_bad), and decoding resumes at the next
+   magic. */
+void wire_decode_rest(const void *buf, size_t len,
+                      void (*rec_cb)(void *arg, struct wire_rec *rec),
+                      void *arg, size_t *nr_bad);
+
+#endif